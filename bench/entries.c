@@ -0,0 +1,94 @@
+/*  cost of reading and of finding every entry of an archive as the number of entries grows
+
+    build from the root of the repository with
+        cc -O2 -I. bench/entries.c -o bench_entries -lzstd -lpthread
+    and run it from a scratch directory, it writes and removes zf_bench.zst:
+        ./bench_entries [max entries]
+
+    the time per entry should stay the same while the entries double
+*/
+
+#define Z_FOLDER_IMPLEMENTATION
+#include "zfolder.h"
+
+#include <time.h>
+
+#define ARCHIVE "zf_bench.zst"
+#define FILE_SIZE 64
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+}
+
+// read every entry, returns the time it took in seconds
+static double read_all(zfolder *dir) {
+    uint64_t sum = 0;
+    double start = now();
+    for (uint32_t i = 0; i < dir->nfiles; ++i)
+        sum += zf_get_file(dir, i)[0];
+    double t = now() - start;
+    // the result is used so the reads can't be optimized away
+    if (sum == 0)
+        fprintf(stderr, "unexpected data\n");
+    return t;
+}
+
+int main(int argc, char **argv) {
+    uint32_t max = argc > 1 ? (uint32_t) atoi(argv[1]) : 400000;
+    // the library reports sizes on stdout
+    if (!freopen("/dev/null", "w", stdout))
+        return 1;
+
+    fprintf(stderr, "%10s %14s %12s %14s %12s %14s %12s\n", "entries", "decompress ms", "ns/entry",
+            "open ms", "ns/entry", "find ms", "ns/entry");
+    for (uint32_t n = 25000; n <= max; n *= 2) {
+        // the files are made in memory, each with its own contents
+        zfolder dir;
+        zf_init(&dir);
+        _zf_reserve(&dir, (uint64_t) n * FILE_SIZE);
+        char path[64];
+        for (uint32_t i = 0; i < n; ++i) {
+            snprintf(path, sizeof(path), "d%u/f%u.bin", i % 256, i);
+            zfile *file = _zf_new_file(&dir, path);
+            file->offset = dir.dlen;
+            file->flen = FILE_SIZE;
+            for (uint32_t k = 0; k < FILE_SIZE; ++k)
+                dir.data[dir.dlen + k] = (uint8_t) (1 + (i >> (k % 24)) + k);
+            dir.dlen += FILE_SIZE;
+        }
+        zf_compress(&dir, ARCHIVE, ZDECENT_COMP);
+        zf_destroy(&dir);
+
+        // everything decompressed at once, then every frame on demand
+        zf_init(&dir);
+        double start = now();
+        zf_decompress(&dir, ARCHIVE);
+        double dec = now() - start + read_all(&dir);
+        zf_destroy(&dir);
+
+        zf_init(&dir);
+        start = now();
+        zf_open(&dir, ARCHIVE);
+        double open = now() - start + read_all(&dir);
+
+        // every path looked up once in the opened archive
+        start = now();
+        uint32_t found = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            snprintf(path, sizeof(path), "d%u/f%u.bin", i % 256, i);
+            uint32_t index;
+            found += zf_find_file(&dir, path, &index) && index == i;
+        }
+        double find = now() - start;
+        if (found != n)
+            fprintf(stderr, "entries not found\n");
+        zf_destroy(&dir);
+
+        fprintf(stderr, "%10u %14.1f %12.1f %14.1f %12.1f %14.1f %12.1f\n", n,
+                dec * 1e3, dec * 1e9 / n, open * 1e3, open * 1e9 / n, find * 1e3, find * 1e9 / n);
+    }
+    remove(ARCHIVE);
+    return 0;
+}
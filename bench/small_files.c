@@ -0,0 +1,75 @@
+/*  extraction of many small files, with stdio or with io_uring (linux only)
+
+    build from the root of the repository, once for each backend
+        cc -O2 -I. bench/small_files.c -o bench_stdio -lzstd -lpthread
+        cc -O2 -I. -DZ_IO_URING bench/small_files.c -o bench_uring -lzstd -lpthread
+    and run them from a scratch directory, they create and remove zf_bench_tmp:
+        ./bench_stdio [nfiles] [file size]
+        ./bench_uring [nfiles] [file size]
+
+    the files are written to the page cache, so the time is mostly syscalls
+*/
+
+#define Z_FOLDER_IMPLEMENTATION
+#include "zfolder.h"
+
+#include <time.h>
+
+#define TMP "zf_bench_tmp"
+#define RUNS 5
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    uint32_t nfiles = argc > 1 ? (uint32_t) atoi(argv[1]) : 20000;
+    size_t size = argc > 2 ? (size_t) atoi(argv[2]) : 2048;
+    // the library reports sizes on stdout
+    if (!freopen("/dev/null", "w", stdout) || system("rm -rf " TMP) != 0)
+        return 1;
+    _create_dir(TMP);
+    _create_dir(TMP "/src");
+
+    uint8_t *data = (uint8_t *) malloc(size ? size : 1);
+    char path[256];
+    for (uint32_t i = 0; i < nfiles; ++i) {
+        if (i % 64 == i) {
+            snprintf(path, sizeof(path), TMP "/src/d%u", i);
+            _create_dir(path);
+        }
+        for (size_t k = 0; k < size; ++k)
+            data[k] = (uint8_t) ('a' + (i * 31 + k * 7) % 26);
+        snprintf(path, sizeof(path), TMP "/src/d%u/f%u.txt", i % 64, i);
+        _write_whole_file(path, data, size);
+    }
+    free(data);
+
+    // only the extraction is timed
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/src", true);
+
+    double best = 0;
+    for (int run = 0; run < RUNS; ++run) {
+        double start = now();
+        zf_decompress_todir(&dir, TMP "/out", true);
+        double t = now() - start;
+        if (run == 0 || t < best)
+            best = t;
+    }
+    zf_destroy(&dir);
+    if (system("rm -rf " TMP) != 0)
+        return 1;
+
+#ifdef Z_URING
+    const char *backend = "io_uring";
+#else
+    const char *backend = "stdio";
+#endif
+    fprintf(stderr, "%s: %u files of %zu b in %.1f ms (%.2f us per file)\n",
+            backend, nfiles, size, best * 1e3, best * 1e6 / nfiles);
+    return 0;
+}
@@ -0,0 +1,1256 @@
+/*  tests for zfolder.h (posix only)
+
+    build from the root of the repository with
+        cc -Wall -O1 -g -I. tests/test.c -o zf_test -lzstd -lpthread
+    and run it from a scratch directory, it creates and removes zf_test_tmp:
+        ./zf_test            // every test
+        ./zf_test compress   // only the tests whose name contains "compress"
+
+    build it again with -DZ_IO_URING, -DZ_MMAP_MIN_SIZE=4096 or -DZ_NO_DIRFD
+    to run the same tests on the other backends
+*/
+
+#define Z_FOLDER_IMPLEMENTATION
+#include "zfolder.h"
+
+#include <sys/wait.h>
+
+#define TMP "zf_test_tmp"
+
+#define CHECK(cond) do { if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); } } while(0)
+
+// == HELPERS ===================================================
+
+static void make_dirs(const char *path) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *c = buf + 1; *c; ++c) {
+        if (*c != '/')
+            continue;
+        *c = '\0';
+        mkdir(buf, 0755);
+        *c = '/';
+    }
+}
+
+static void write_file(const char *path, const void *data, size_t len) {
+    make_dirs(path);
+    FILE *f = fopen(path, "wb");
+    CHECK(f);
+    CHECK(len == 0 || fwrite(data, len, 1, f) == 1);
+    fclose(f);
+}
+
+static uint8_t *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *len = (size_t) ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = (uint8_t *) malloc(*len ? *len : 1);
+    CHECK(data && (*len == 0 || fread(data, *len, 1, f) == 1));
+    fclose(f);
+    return data;
+}
+
+// compressible text made of words picked by a xorshift
+static void fill(uint8_t *buf, size_t len, uint32_t seed) {
+    static const char *words[] = { "zstd ", "frame ", "index ", "chunk ", "folder ", "file\n", "data ", "block " };
+    uint32_t x = seed * 2654435761u + 1;
+    size_t pos = 0;
+    while (pos < len) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        const char *w = words[x % 8];
+        size_t n = strlen(w);
+        if (n > len - pos)
+            n = len - pos;
+        memcpy(buf + pos, w, n);
+        pos += n;
+    }
+}
+
+static void make_file(const char *path, size_t len, uint32_t seed) {
+    uint8_t *buf = (uint8_t *) malloc(len ? len : 1);
+    CHECK(buf);
+    fill(buf, len, seed);
+    write_file(path, buf, len);
+    free(buf);
+}
+
+// nested directories with files of many sizes (and an empty one)
+static void make_tree(const char *root, int nfiles, uint32_t seed) {
+    char path[512];
+    for (int i = 0; i < nfiles; ++i) {
+        snprintf(path, sizeof(path), "%s/d%d/s%d/f%d.txt", root, i % 3, i % 5, i);
+        make_file(path, (size_t) ((i * 7919u + seed) % 20000), seed + (uint32_t) i);
+    }
+    snprintf(path, sizeof(path), "%s/empty", root);
+    write_file(path, "", 0);
+}
+
+static int count_files(const char *root) {
+    DIR *d = opendir(root);
+    if (!d)
+        return 0;
+    int count = 0;
+    struct dirent *ent;
+    char path[1024];
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", root, ent->d_name);
+        if (ent->d_type == DT_DIR)
+            count += count_files(path);
+        else
+            count++;
+    }
+    closedir(d);
+    return count;
+}
+
+// every file under a is in b with the same contents, and b has no other file
+static void check_same_tree(const char *a, const char *b) {
+    DIR *d = opendir(a);
+    CHECK(d);
+    struct dirent *ent;
+    char pa[1024], pb[1024];
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        snprintf(pa, sizeof(pa), "%s/%s", a, ent->d_name);
+        snprintf(pb, sizeof(pb), "%s/%s", b, ent->d_name);
+        if (ent->d_type == DT_DIR) {
+            check_same_tree(pa, pb);
+            continue;
+        }
+        size_t la, lb;
+        uint8_t *da = read_file(pa, &la);
+        uint8_t *db = read_file(pb, &lb);
+        if (!db || la != lb || memcmp(da, db, la) != 0) {
+            fprintf(stderr, "%s and %s differ\n", pa, pb);
+            exit(1);
+        }
+        free(da);
+        free(db);
+    }
+    closedir(d);
+    CHECK(count_files(a) == count_files(b));
+}
+
+// every file of the archive has the contents of the file with its path on disk
+static void check_archive(const char *archive, int nfiles) {
+    zfolder arc;
+    zf_init(&arc);
+    zf_open(&arc, archive);
+    CHECK((int) arc.nfiles == nfiles);
+    for (uint32_t i = 0; i < arc.nfiles; ++i) {
+        size_t len;
+        uint8_t *data = read_file(zf_get_path(&arc, i), &len);
+        CHECK(data && len == arc.files[i].flen);
+        CHECK(len == 0 || memcmp(zf_get_file(&arc, i), data, len) == 0);
+        free(data);
+    }
+    zf_destroy(&arc);
+}
+
+// extract with every decompressor and compare the result with root
+static void check_extract(const char *archive, const char *root) {
+    char out[256];
+    snprintf(out, sizeof(out), "rm -rf %s/out", TMP);
+    CHECK(system(out) == 0);
+    mkdir(TMP "/out", 0755);
+
+    zfolder dec;
+    zf_init(&dec);
+    zf_decompress(&dec, archive);
+    zf_decompress_todir(&dec, TMP "/out/todir", true);
+    zf_decompress_todir_parallel(&dec, TMP "/out/parallel", true, 3);
+    zf_destroy(&dec);
+    snprintf(out, sizeof(out), "%s/out/todir/%s", TMP, root);
+    check_same_tree(root, out);
+    snprintf(out, sizeof(out), "%s/out/parallel/%s", TMP, root);
+    check_same_tree(root, out);
+
+    zf_extract_stream(archive, TMP "/out/stream", true);
+    snprintf(out, sizeof(out), "%s/out/stream/%s", TMP, root);
+    check_same_tree(root, out);
+}
+
+// run fn in a child process, it has to stop with crash()
+static void check_crash(void (*fn)(void *), void *arg) {
+    fflush(NULL);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        if (!freopen("/dev/null", "w", stderr))
+            _exit(2);
+        fn(arg);
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+}
+
+static void open_archive(void *path) {
+    zfolder dir;
+    zf_init(&dir);
+    zf_open(&dir, (const char *) path);
+    for (uint32_t i = 0; i < dir.nfiles; ++i)
+        zf_get_file(&dir, i);
+    zf_destroy(&dir);
+}
+
+static void decompress_archive(void *path) {
+    zfolder dir;
+    zf_init(&dir);
+    zf_decompress(&dir, (const char *) path);
+    zf_destroy(&dir);
+}
+
+// an archive made by hand: every part is a frame, the last one is the index
+static void write_archive(const char *path, const uint8_t **parts, const size_t *lens, uint32_t nparts) {
+    FILE *f = fopen(path, "wb");
+    CHECK(f);
+    _zf_frame frames[16];
+    CHECK(nparts <= 16);
+    for (uint32_t i = 0; i < nparts; ++i) {
+        size_t cap = ZSTD_compressBound(lens[i]);
+        uint8_t *buf = (uint8_t *) malloc(cap);
+        CHECK(buf);
+        size_t csize = ZSTD_compress(buf, cap, parts[i], lens[i], 1);
+        CHECK(!ZSTD_isError(csize));
+        CHECK(fwrite(buf, csize, 1, f) == 1);
+        frames[i].csize = csize;
+        frames[i].dsize = lens[i];
+        free(buf);
+    }
+    _zf_write_seek_table(f, frames, nparts);
+    fclose(f);
+}
+
+// the index of a version 4 archive with a single file, or none if flen is 0
+static size_t make_index(uint8_t *buf, uint64_t flen, uint64_t offset, uint64_t dlen) {
+    uint8_t *p = buf;
+    p += _zf_put_varint(p, flen ? 1 : 0);
+    if (flen) {
+        p += _zf_put_varint(p, 1);      // plen
+        p += _zf_put_varint(p, flen);
+        p += _zf_put_varint(p, offset);
+        *p++ = 'x';
+        p += _zf_put_varint(p, 0);      // chunked
+        p += _zf_put_varint(p, 0);      // mtime
+        p += _zf_put_varint(p, 0);      // ino
+    }
+    p += _zf_put_varint(p, dlen);
+    p += _zf_put_varint(p, 0);          // dict
+    p += _zf_put_varint(p, 0);          // nchunks
+    p += _zf_put_varint(p, 0);          // window_log
+    return (size_t) (p - buf);
+}
+
+// == TESTS =====================================================
+
+static void test_compress(void) {
+    make_tree(TMP "/tree", 60, 1);
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zf_compress(&dir, TMP "/a.zst", ZDECENT_COMP);
+    zf_destroy(&dir);
+
+    check_archive(TMP "/a.zst", 61);
+    check_extract(TMP "/a.zst", TMP "/tree");
+}
+
+static void test_zstd_workers(void) {
+    make_tree(TMP "/tree", 40, 21);
+    CHECK(_zf_cpu_count() >= 1);
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    // a single frame split between zstd workers, the job size doesn't fit in an int
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.nthreads = 2;
+    opt.block_size = 0;
+    opt.job_size = (size_t) -1;
+    opt.overlap_log = 9;
+    zf_compress_opt(&dir, TMP "/a.zst", &opt);
+    zf_destroy(&dir);
+
+    check_archive(TMP "/a.zst", 41);
+    check_extract(TMP "/a.zst", TMP "/tree");
+}
+
+static void test_extract_file(void) {
+    make_tree(TMP "/tree", 50, 19);
+    // the second file is a copy of the first but for its last bytes, so it has chunks
+    make_file(TMP "/tree/big1.txt", 60000, 20);
+    size_t big_len;
+    uint8_t *big = read_file(TMP "/tree/big1.txt", &big_len);
+    CHECK(big);
+    memcpy(big + big_len - 5, "tail\n", 5);
+    write_file(TMP "/tree/big2.txt", big, big_len);
+    free(big);
+
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.block_size = 4096;
+    opt.chunk_size = 4096;
+    zf_compress_opt(&dir, TMP "/a.zst", &opt);
+
+    for (uint32_t i = 0; i < dir.nfiles; ++i) {
+        uint64_t len;
+        uint8_t *data = zf_extract_file(TMP "/a.zst", zf_get_path(&dir, i), &len);
+        CHECK(data && len == dir.files[i].flen);
+        CHECK(len == 0 || memcmp(data, zf_get_file(&dir, i), (size_t) len) == 0);
+        free(data);
+    }
+    uint64_t len;
+    CHECK(!zf_extract_file(TMP "/a.zst", TMP "/tree/missing.txt", &len));
+    zf_destroy(&dir);
+}
+
+static void test_compress_threads(void) {
+    make_tree(TMP "/tree", 80, 12);
+    // a piece bigger than the blocks, it goes to the stream between them
+    make_file(TMP "/tree/big.txt", 100000, 13);
+    // on the calling thread as well, without any worker
+    int threads[] = { ZNO_THREADS, 1, 4 };
+    for (int lazy = 0; lazy < 2; ++lazy) {
+        for (int t = 0; t < 3; ++t) {
+            zfolder dir;
+            zf_init(&dir);
+            dir.lazy = lazy;
+            zf_add_dir(&dir, TMP "/tree", true);
+            zoptions opt = zf_default_options(ZDECENT_COMP);
+            opt.nthreads = threads[t];
+            opt.block_size = 16 << 10;
+            opt.dict_size = lazy ? 0 : 16 << 10;
+            zf_compress_opt(&dir, TMP "/a.zst", &opt);
+            zf_destroy(&dir);
+
+            check_archive(TMP "/a.zst", 82);
+            check_extract(TMP "/a.zst", TMP "/tree");
+        }
+    }
+}
+
+
+// archive written before version 1: a header and the data, in one frame or
+// in a header frame and a frame per file followed by a skippable frame
+static void write_legacy(const char *path, const char **names, const uint8_t **data,
+                         const uint32_t *lens, uint32_t nfiles, uint32_t dlen, bool frames) {
+    uint8_t header[4096];
+    uint8_t *p = header;
+    memcpy(p, &nfiles, 4);
+    p += 4;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < nfiles; ++i) {
+        uint8_t plen = (uint8_t) strlen(names[i]);
+        *p++ = plen;
+        memcpy(p, &lens[i], 4);
+        memcpy(p + 4, names[i], plen);
+        p += 4 + plen;
+        total += lens[i];
+    }
+    memcpy(p, &dlen, 4);
+    p += 4;
+
+    size_t len = (size_t) (p - header) + total;
+    uint8_t *raw = (uint8_t *) malloc(len);
+    uint8_t *out = (uint8_t *) malloc(ZSTD_compressBound(len) * 2 + 64);
+    CHECK(raw && out);
+    memcpy(raw, header, (size_t) (p - header));
+    size_t pos = (size_t) (p - header);
+    for (uint32_t i = 0; i < nfiles; ++i) {
+        memcpy(raw + pos, data[i], lens[i]);
+        pos += lens[i];
+    }
+
+    size_t olen = 0;
+    if (!frames) {
+        olen = ZSTD_compress(out, ZSTD_compressBound(len), raw, len, 3);
+        CHECK(!ZSTD_isError(olen));
+    }
+    else {
+        size_t start = 0;
+        size_t end = (size_t) (p - header);
+        for (uint32_t i = 0; i <= nfiles; ++i) {
+            size_t n = ZSTD_compress(out + olen, ZSTD_compressBound(end - start), raw + start, end - start, 3);
+            CHECK(!ZSTD_isError(n));
+            olen += n;
+            start = end;
+            end += i < nfiles ? lens[i] : 0;
+        }
+        // the footer of the zstd seekable format, ignored by the readers
+        uint32_t magic = ZSTD_MAGIC_SKIPPABLE_START | 0xE, size = 9;
+        uint8_t footer[9] = { 0, 0, 0, 0, 0, 0xB1, 0xEA, 0x92, 0x8F };
+        memcpy(out + olen, &magic, 4);
+        memcpy(out + olen + 4, &size, 4);
+        memcpy(out + olen + 8, footer, 9);
+        olen += 17;
+    }
+    write_file(path, out, olen);
+    free(raw);
+    free(out);
+}
+
+static void incremental_run(const char *path, const char *previous, bool lazy) {
+    zfolder dir;
+    zf_init(&dir);
+    dir.lazy = lazy;
+    zf_add_dir(&dir, TMP "/tree", true);
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.block_size = 8192;
+    zf_compress_incremental(&dir, path, previous, &opt);
+    zf_destroy(&dir);
+}
+
+static void append_legacy(void *arg) {
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_file(&dir, TMP "/tree/a.txt");
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    zf_append(&dir, (const char *) arg, &opt);
+}
+
+static void test_legacy(void) {
+    const char *names[3] = { TMP "/tree/a.txt", TMP "/tree/d/b.txt", TMP "/tree/empty" };
+    uint8_t a[3000], b[700];
+    fill(a, sizeof(a), 18);
+    fill(b, sizeof(b), 19);
+    const uint8_t *data[3] = { a, b, a };
+    uint32_t lens[3] = { sizeof(a), sizeof(b), 0 };
+    write_file(names[0], a, sizeof(a));
+    write_file(names[1], b, sizeof(b));
+    write_file(names[2], "", 0);
+
+    for (int frames = 0; frames < 2; ++frames) {
+        write_legacy(TMP "/old.zst", names, data, lens, 3, sizeof(a) + sizeof(b), frames);
+        check_archive(TMP "/old.zst", 3);
+        check_extract(TMP "/old.zst", TMP "/tree");
+        uint64_t len;
+        uint8_t *file = zf_extract_file(TMP "/old.zst", names[1], &len);
+        CHECK(file && len == sizeof(b) && memcmp(file, b, len) == 0);
+        free(file);
+    }
+
+    // it has no seek table to append to
+    check_crash(append_legacy, TMP "/old.zst");
+
+    // the first incremental compression can start from it
+    make_file(TMP "/tree/new.txt", 100, 20);
+    incremental_run(TMP "/old.zst", TMP "/old.zst", true);
+    check_archive(TMP "/old.zst", 4);
+
+    // files past the end of the data
+    write_legacy(TMP "/bad.zst", names, data, lens, 3, sizeof(a), false);
+    check_crash(open_archive, TMP "/bad.zst");
+}
+
+static void test_get_file(void) {
+    // files of an opened archive in reverse order, the blocks are loaded back to front
+    make_tree(TMP "/tree", 60, 49);
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.block_size = 8192;
+    zf_compress_opt(&dir, TMP "/a.zst", &opt);
+    zf_destroy(&dir);
+
+    zf_init(&dir);
+    zf_open(&dir, TMP "/a.zst");
+    for (uint32_t i = dir.nfiles; i-- > 0;) {
+        size_t len;
+        uint8_t *data = read_file(zf_get_path(&dir, i), &len);
+        CHECK(data && len == dir.files[i].flen);
+        CHECK(len == 0 || memcmp(zf_get_file(&dir, i), data, len) == 0);
+        free(data);
+    }
+    zf_destroy(&dir);
+}
+
+static void test_clear(void) {
+    make_tree(TMP "/tree", 30, 21);
+    make_tree(TMP "/other", 20, 22);
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zf_compress(&dir, TMP "/a.zst", ZDECENT_COMP);
+    size_t dcap = dir.dcap;
+
+    // an opened archive is closed, the buffers are kept for the next files
+    zf_clear(&dir);
+    zf_open(&dir, TMP "/a.zst");
+    zf_get_file(&dir, 0);
+    zf_clear(&dir);
+    CHECK(dir.nfiles == 0 && dir.dlen == 0 && !dir.archive);
+    CHECK(dir.dcap >= dcap);
+    zf_add_dir(&dir, TMP "/other", true);
+    uint32_t index;
+    CHECK(!zf_find_file(&dir, TMP "/tree/empty", &index));
+    zf_compress(&dir, TMP "/b.zst", ZDECENT_COMP);
+    zf_destroy(&dir);
+
+    check_archive(TMP "/b.zst", 21);
+    check_extract(TMP "/b.zst", TMP "/other");
+}
+
+static void test_many_files(void) {
+    // the table has no padding between the fields of a file
+    CHECK(sizeof(zfile) == 4 * sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t) + 1);
+
+    // more files than the fixed table used to hold
+    char path[256];
+    for (int i = 0; i < 5000; ++i) {
+        snprintf(path, sizeof(path), "%s/tree/d%d/f%d.txt", TMP, i % 10, i);
+        make_file(path, (size_t) (i % 97), (uint32_t) i);
+    }
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    CHECK(dir.nfiles == 5000);
+    zf_compress(&dir, TMP "/a.zst", ZDECENT_COMP);
+    zf_destroy(&dir);
+
+    check_archive(TMP "/a.zst", 5000);
+    check_extract(TMP "/a.zst", TMP "/tree");
+}
+
+static void test_long_paths(void) {
+    // paths longer than the 128 bytes a file used to have for its path
+    char name[201];
+    memset(name, 'n', 200);
+    name[200] = '\0';
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/tree/%s.txt", TMP, name);
+    make_file(path, 1000, 23);
+    snprintf(path, sizeof(path), "%s/tree/%.100s/%.100s/%.100s/x", TMP, name, name, name);
+    make_file(path, 2000, 24);
+    make_file(TMP "/tree/s", 10, 25);
+
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    uint32_t index;
+    CHECK(zf_find_file(&dir, path, &index));
+    CHECK(strcmp(zf_get_path(&dir, index), path) == 0);
+    zf_compress(&dir, TMP "/a.zst", ZDECENT_COMP);
+    zf_destroy(&dir);
+
+    check_archive(TMP "/a.zst", 3);
+    check_extract(TMP "/a.zst", TMP "/tree");
+}
+
+static void test_large_sizes(void) {
+    uint64_t values[] = { 0, 127, 128, UINT32_MAX, (uint64_t) UINT32_MAX + 1, (1ull << 40) + 3, UINT64_MAX };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        uint8_t buf[Z_MAX_VARINT_SIZE];
+        size_t n = _zf_put_varint(buf, values[i]);
+        CHECK(n == _zf_varint_size(values[i]));
+        uint8_t *p = buf;
+        CHECK(_zf_get_varint(&p, buf + n) == values[i] && p == buf + n);
+    }
+
+    // sizes and offsets over 4 GB that would be in the data if they
+    // were cut to 32 bits, they have to be found past its end
+    uint8_t data[100] = { 0 };
+    uint8_t index[64];
+    const uint8_t *parts[2] = { data, index };
+    size_t lens[2] = { sizeof(data), 0 };
+    lens[1] = make_index(index, 10, (uint64_t) 1 << 32, sizeof(data));
+    write_archive(TMP "/a.zst", parts, lens, 2);
+    check_crash(open_archive, TMP "/a.zst");
+    lens[1] = make_index(index, ((uint64_t) 1 << 32) + 10, 0, sizeof(data));
+    write_archive(TMP "/a.zst", parts, lens, 2);
+    check_crash(open_archive, TMP "/a.zst");
+    check_crash(decompress_archive, TMP "/a.zst");
+}
+
+static void test_walk_parallel(void) {
+    make_tree(TMP "/tree", 300, 17);
+    make_file(TMP "/tree/deep/a/b/c/d/e/f.txt", 100, 18);
+    zfolder dir, par;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zf_init(&par);
+    zf_add_dir_parallel(&par, TMP "/tree", true, 4);
+    CHECK(par.nfiles == dir.nfiles);
+    for (uint32_t i = 0; i < dir.nfiles; ++i) {
+        uint32_t index;
+        CHECK(zf_find_file(&par, zf_get_path(&dir, i), &index));
+        CHECK(par.files[index].flen == dir.files[i].flen);
+        CHECK(memcmp(zf_get_file(&par, index), zf_get_file(&dir, i), dir.files[i].flen) == 0);
+    }
+    zf_destroy(&dir);
+    zf_destroy(&par);
+}
+
+static void test_walk_entries(void) {
+    // only regular files are added, links and fifos are skipped
+    make_tree(TMP "/tree", 20, 26);
+    make_file(TMP "/tree/.hidden", 100, 27);
+    mkdir(TMP "/tree/nothing", 0755);
+    CHECK(symlink("d0", TMP "/tree/link_dir") == 0);
+    CHECK(symlink(".hidden", TMP "/tree/link_file") == 0);
+    CHECK(mkfifo(TMP "/tree/fifo", 0644) == 0);
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    CHECK(dir.nfiles == 22);
+    uint32_t index;
+    CHECK(zf_find_file(&dir, TMP "/tree/.hidden", &index));
+    zf_destroy(&dir);
+
+    // without recursion only the files of the root
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", false);
+    CHECK(dir.nfiles == 2);
+    zf_destroy(&dir);
+    zf_init(&dir);
+    zf_add_dir_parallel(&dir, TMP "/tree", false, 2);
+    CHECK(dir.nfiles == 2);
+    zf_destroy(&dir);
+}
+
+static void decompress_existing(void *arg) {
+    zfolder dir;
+    zf_init(&dir);
+    zf_decompress(&dir, TMP "/a.zst");
+    zf_decompress_todir(&dir, (const char *) arg, false);
+}
+
+
+static void test_extract_dirs(void) {
+    // directories whose names sort around their siblings and children,
+    // added out of order so that the files of a directory aren't together
+    static const char *paths[] = {
+        TMP "/tree/x/a/b/f1", TMP "/tree/x/a-b/f2", TMP "/tree/y/f3", TMP "/tree/x/a/f4",
+        TMP "/tree/x/a.b/c/d/f5", TMP "/tree/x/a/b/f6", TMP "/tree/f7",
+    };
+    zfolder dir;
+    zf_init(&dir);
+    for (int i = 0; i < 7; ++i) {
+        make_file(paths[i], (size_t) (100 * i), 28 + (uint32_t) i);
+        zf_add_file(&dir, paths[i]);
+    }
+    zf_compress(&dir, TMP "/a.zst", ZDECENT_COMP);
+    zf_destroy(&dir);
+    check_extract(TMP "/a.zst", TMP "/tree");
+
+    // the output exists and can't be overwritten
+    check_crash(decompress_existing, TMP "/out/todir");
+}
+
+static void test_extract_big(void) {
+    // files written one at a time between the batches of io_uring:
+    // bigger than Z_URING_MAX_FILE, and made of chunks
+    make_tree(TMP "/tree", 150, 35);
+    size_t len = (1 << 20) + 12345;
+    uint8_t *big = (uint8_t *) malloc(len);
+    CHECK(big);
+    fill(big, len, 36);
+    write_file(TMP "/tree/d1/big.txt", big, len);
+    big[len / 2] ^= 1;
+    write_file(TMP "/tree/d2/near.txt", big, len);
+    free(big);
+
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.chunk_size = 8192;
+    zf_compress_opt(&dir, TMP "/a.zst", &opt);
+    zf_destroy(&dir);
+
+    check_archive(TMP "/a.zst", 153);
+    check_extract(TMP "/a.zst", TMP "/tree");
+}
+
+static void test_read_batches(void) {
+    // more files in a directory than an io_uring batch, empty ones,
+    // and one read on its own because it is bigger than Z_URING_MAX_FILE
+    char path[256];
+    for (int i = 0; i < 200; ++i) {
+        snprintf(path, sizeof(path), "%s/tree/f%d.txt", TMP, i);
+        make_file(path, (size_t) (i % 4 == 0 ? 0 : i * 37), 40 + (uint32_t) i);
+    }
+    make_file(TMP "/tree/sub/big.txt", (1 << 20) + 1, 41);
+    make_tree(TMP "/other", 30, 42);
+
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zf_add_dir(&dir, TMP "/other", true);
+    CHECK(dir.nfiles == 232);
+    for (uint32_t i = 0; i < dir.nfiles; ++i) {
+        size_t len;
+        uint8_t *data = read_file(zf_get_path(&dir, i), &len);
+        CHECK(data && len == dir.files[i].flen);
+        CHECK(len == 0 || memcmp(zf_get_file(&dir, i), data, len) == 0);
+        free(data);
+    }
+    zf_destroy(&dir);
+}
+
+#ifdef Z_MMAP
+static void test_mmap(void) {
+    // files of at least Z_MMAP_MIN_SIZE bytes are mapped, the others are copied
+    make_file(TMP "/tree/small.txt", Z_MMAP_MIN_SIZE - 1, 43);
+    make_file(TMP "/tree/mapped.txt", Z_MMAP_MIN_SIZE, 44);
+    make_file(TMP "/tree/d/big.txt", Z_MMAP_MIN_SIZE * 10 + 7, 45);
+    for (int nthreads = 1; nthreads <= 2; ++nthreads) {
+        zfolder dir;
+        zf_init(&dir);
+        if (nthreads == 1)
+            zf_add_dir(&dir, TMP "/tree", true);
+        else
+            zf_add_dir_parallel(&dir, TMP "/tree", true, nthreads);
+        CHECK(dir.nfiles == 3);
+        for (uint32_t i = 0; i < dir.nfiles; ++i)
+            CHECK((dir.files[i].source == ZFILE_MAPPED) == (dir.files[i].flen >= Z_MMAP_MIN_SIZE));
+        // on two threads a mapped file and a copied one share a block
+        zoptions opt = zf_default_options(ZDECENT_COMP);
+        opt.nthreads = nthreads;
+        opt.block_size = Z_MMAP_MIN_SIZE * 4;
+        zf_compress_opt(&dir, TMP "/a.zst", &opt);
+        zf_destroy(&dir);
+
+        check_archive(TMP "/a.zst", 3);
+        check_extract(TMP "/a.zst", TMP "/tree");
+    }
+}
+#endif
+
+static void compress_lazy(void *arg) {
+    zfolder dir;
+    zf_init(&dir);
+    dir.lazy = true;
+    zf_add_dir(&dir, (const char *) arg, true);
+    remove(TMP "/tree/d0/s0/f0.txt");
+    zf_compress(&dir, TMP "/b.zst", ZDECENT_COMP);
+}
+
+static void test_lazy(void) {
+    // nothing is read when the files are added
+    make_tree(TMP "/tree", 40, 46);
+    make_file(TMP "/single.txt", 3000, 47);
+    zfolder dir;
+    zf_init(&dir);
+    dir.lazy = true;
+    zf_add_dir(&dir, TMP "/tree", true);
+    zf_add_file(&dir, TMP "/single.txt");
+    CHECK(dir.nfiles == 42 && dir.dlen == 0);
+    for (uint32_t i = 0; i < dir.nfiles; ++i)
+        CHECK(dir.files[i].source == ZFILE_DISK);
+    zf_compress(&dir, TMP "/a.zst", ZDECENT_COMP);
+    zf_destroy(&dir);
+    check_archive(TMP "/a.zst", 42);
+    check_extract(TMP "/a.zst", TMP "/tree");
+
+    // a file removed before it is compressed
+    check_crash(compress_lazy, TMP "/tree");
+}
+
+static void test_malformed_frames(void) {
+    size_t len = 1 << 20;
+    uint8_t *data = (uint8_t *) calloc(1, len);
+    CHECK(data);
+    uint8_t index[64];
+    const uint8_t *parts[3] = { data, data, index };
+    size_t lens[3] = { len, 100, 0 };
+
+    // the well formed archive first, so the failures below are the checks
+    lens[1] = make_index(index, 16, 0, len);
+    parts[1] = index;
+    write_archive(TMP "/ok.zst", parts, lens, 2);
+    decompress_archive(TMP "/ok.zst");
+    open_archive(TMP "/ok.zst");
+
+    // the frame is bigger than the data of the index
+    lens[1] = make_index(index, 0, 0, 16);
+    write_archive(TMP "/small.zst", parts, lens, 2);
+    check_crash(decompress_archive, TMP "/small.zst");
+    check_crash(open_archive, TMP "/small.zst");
+
+    // a file that starts in a frame and ends in the next one
+    parts[1] = data;
+    lens[1] = 100;
+    parts[2] = index;
+    lens[2] = make_index(index, 100, len - 50, len + 100);
+    write_archive(TMP "/split.zst", parts, lens, 3);
+    check_crash(open_archive, TMP "/split.zst");
+
+    // a file past the end of the data
+    lens[2] = make_index(index, 200, len, len + 100);
+    write_archive(TMP "/past.zst", parts, lens, 3);
+    check_crash(open_archive, TMP "/past.zst");
+    free(data);
+}
+
+static bool has_dict(const char *archive) {
+    zfolder dir;
+    zf_init(&dir);
+    zf_open(&dir, archive);
+    zf_get_file(&dir, 0);
+    bool dict = ((_zf_archive *) dir.archive)->ddict != NULL;
+    zf_destroy(&dir);
+    return dict;
+}
+
+static void test_dict(void) {
+    // a single file is too little to train on, it is compressed without one
+    make_file(TMP "/tree/one.txt", 300, 15);
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.block_size = 4096;
+    opt.dict_size = 4096;
+    zf_compress_opt(&dir, TMP "/a.zst", &opt);
+    zf_destroy(&dir);
+    CHECK(!has_dict(TMP "/a.zst"));
+    check_extract(TMP "/a.zst", TMP "/tree");
+
+    make_tree(TMP "/tree", 200, 16);
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zf_compress_opt(&dir, TMP "/a.zst", &opt);
+    zf_destroy(&dir);
+    CHECK(has_dict(TMP "/a.zst"));
+    check_archive(TMP "/a.zst", 202);
+    check_extract(TMP "/a.zst", TMP "/tree");
+}
+
+static uint64_t offset_of(zfolder *dir, const char *path) {
+    uint32_t index;
+    CHECK(zf_find_file(dir, path, &index));
+    return dir->files[index].offset;
+}
+
+static void test_dedup(void) {
+    // copies of a file, and files of the same length that differ in a byte
+    uint8_t *buf = (uint8_t *) malloc(50000);
+    CHECK(buf);
+    fill(buf, 50000, 14);
+    write_file(TMP "/tree/a/orig.txt", buf, 50000);
+    write_file(TMP "/tree/b/copy.txt", buf, 50000);
+    write_file(TMP "/tree/c/copy.txt", buf, 50000);
+    buf[49999] ^= 1;
+    write_file(TMP "/tree/a/last.txt", buf, 50000);
+    buf[49999] ^= 1;
+    buf[0] ^= 1;
+    write_file(TMP "/tree/b/first.txt", buf, 50000);
+    free(buf);
+
+    for (int lazy = 0; lazy < 2; ++lazy) {
+        for (int nthreads = 1; nthreads <= 2; ++nthreads) {
+            zfolder dir;
+            zf_init(&dir);
+            dir.lazy = lazy;
+            zf_add_dir(&dir, TMP "/tree", true);
+            // one file in memory and the others on disk
+            if (lazy)
+                zf_get_file(&dir, 0);
+            zoptions opt = zf_default_options(ZDECENT_COMP);
+            opt.nthreads = nthreads;
+            opt.block_size = 128 << 10;
+            zf_compress_opt(&dir, TMP "/a.zst", &opt);
+            zf_destroy(&dir);
+
+            check_archive(TMP "/a.zst", 5);
+            check_extract(TMP "/a.zst", TMP "/tree");
+
+            zf_init(&dir);
+            zf_open(&dir, TMP "/a.zst");
+            uint64_t orig = offset_of(&dir, TMP "/tree/a/orig.txt");
+            CHECK(offset_of(&dir, TMP "/tree/b/copy.txt") == orig);
+            CHECK(offset_of(&dir, TMP "/tree/c/copy.txt") == orig);
+            CHECK(offset_of(&dir, TMP "/tree/a/last.txt") != orig);
+            CHECK(offset_of(&dir, TMP "/tree/b/first.txt") != orig);
+            CHECK(dir.dlen == 3 * 50000);
+            zf_destroy(&dir);
+        }
+    }
+}
+
+static void test_chunks(void) {
+    // near duplicates bigger than the window lazy files are chunked in
+    size_t len = 3 << 20;
+    uint8_t *buf = (uint8_t *) malloc(len + 100);
+    CHECK(buf);
+    fill(buf, len, 15);
+    write_file(TMP "/tree/a.txt", buf, len);
+    memcpy(buf + 1000, "inserted in the middle", 22);
+    memmove(buf + 2000000 + 100, buf + 2000000, len - 2000000);
+    fill(buf + 2000000, 100, 16);
+    write_file(TMP "/tree/b.txt", buf, len + 100);
+    write_file(TMP "/tree/c.txt", buf + 5, len - 5);
+    make_file(TMP "/tree/small.txt", 500, 17);
+    free(buf);
+
+    uint64_t dlen[2];
+    uint32_t nchunks[2];
+    for (int lazy = 0; lazy < 2; ++lazy) {
+        zfolder dir;
+        zf_init(&dir);
+        dir.lazy = lazy;
+        zf_add_dir(&dir, TMP "/tree", true);
+        zoptions opt = zf_default_options(ZDECENT_COMP);
+        opt.chunk_size = 4096;
+        opt.block_size = 64 << 10;
+        // the lazy files go through the compression threads
+        opt.nthreads = lazy ? 4 : 1;
+        zf_compress_opt(&dir, TMP "/a.zst", &opt);
+        zf_destroy(&dir);
+
+        check_archive(TMP "/a.zst", 4);
+        check_extract(TMP "/a.zst", TMP "/tree");
+
+        zf_init(&dir);
+        zf_open(&dir, TMP "/a.zst");
+        dlen[lazy] = dir.dlen;
+        nchunks[lazy] = dir.nchunks;
+        zf_destroy(&dir);
+    }
+    // the files share most of their chunks, and lazy files are cut the same way
+    CHECK(dlen[0] < len + len / 4);
+    CHECK(dlen[0] == dlen[1] && nchunks[0] == nchunks[1]);
+}
+
+static void test_malformed_index(void) {
+    uint8_t data[100] = { 0 };
+    uint8_t index[64];
+    const uint8_t *parts[2] = { data, index };
+    size_t lens[2] = { sizeof(data), 0 };
+
+    // more files than the index has bytes
+    uint8_t *p = index;
+    p += _zf_put_varint(p, 1000);
+    p += _zf_put_varint(p, 0);
+    lens[1] = (size_t) (p - index);
+    write_archive(TMP "/a.zst", parts, lens, 2);
+    check_crash(open_archive, TMP "/a.zst");
+
+    // a chunked file whose chunks are past the chunk table
+    p = index;
+    p += _zf_put_varint(p, 1);
+    p += _zf_put_varint(p, 1);
+    p += _zf_put_varint(p, 50);     // flen
+    p += _zf_put_varint(p, 0);      // first chunk
+    *p++ = 'x';
+    p += _zf_put_varint(p, 1);      // chunked
+    p += _zf_put_varint(p, 0);      // mtime
+    p += _zf_put_varint(p, 0);      // ino
+    p += _zf_put_varint(p, sizeof(data));
+    p += _zf_put_varint(p, 0);
+    p += _zf_put_varint(p, 1);      // nchunks
+    p += _zf_put_varint(p, 0);
+    p += _zf_put_varint(p, 20);     // 20 of the 50 bytes
+    p += _zf_put_varint(p, 0);      // window_log
+    lens[1] = (size_t) (p - index);
+    write_archive(TMP "/a.zst", parts, lens, 2);
+    check_crash(open_archive, TMP "/a.zst");
+
+    // the index is cut short
+    lens[1] = make_index(index, 10, 0, sizeof(data)) - 3;
+    write_archive(TMP "/a.zst", parts, lens, 2);
+    check_crash(open_archive, TMP "/a.zst");
+
+    // a seek table bigger than the file, and a version from the future
+    lens[1] = make_index(index, 10, 0, sizeof(data));
+    write_archive(TMP "/a.zst", parts, lens, 2);
+    size_t len;
+    uint8_t *archive = read_file(TMP "/a.zst", &len);
+    CHECK(archive);
+    uint32_t table_len = 1 << 20;
+    memcpy(archive + len - Z_SEEK_FOOTER_SIZE, &table_len, 4);
+    write_file(TMP "/b.zst", archive, len);
+    check_crash(open_archive, TMP "/b.zst");
+    archive[len - 5] = Z_FORMAT_VERSION + 1;
+    write_file(TMP "/b.zst", archive, len);
+    check_crash(open_archive, TMP "/b.zst");
+    free(archive);
+}
+
+static void test_append(void) {
+    make_tree(TMP "/tree", 30, 2);
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.block_size = 8192;
+    zf_compress_opt(&dir, TMP "/a.zst", &opt);
+    zf_destroy(&dir);
+
+    // a new file and a replaced one
+    make_file(TMP "/tree/new/n.txt", 5000, 3);
+    make_file(TMP "/tree/d0/s0/f0.txt", 3000, 4);
+    zf_init(&dir);
+    zf_add_file(&dir, TMP "/tree/new/n.txt");
+    zf_add_file(&dir, TMP "/tree/d0/s0/f0.txt");
+    zf_append(&dir, TMP "/a.zst", &opt);
+    zf_destroy(&dir);
+
+    check_archive(TMP "/a.zst", 32);
+    check_extract(TMP "/a.zst", TMP "/tree");
+}
+
+static void append_missing(void *arg) {
+    (void) arg;
+    zfolder dir;
+    zf_init(&dir);
+    dir.lazy = true;
+    zf_add_file(&dir, TMP "/tree/big.txt");
+    zf_add_file(&dir, TMP "/tree/victim.txt");
+    remove(TMP "/tree/victim.txt");
+    // without dedup nothing reads it before big.txt is written
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.dedup = false;
+    opt.block_size = 8192;
+    zf_append(&dir, TMP "/a.zst", &opt);
+}
+
+static void test_append_failed(void) {
+    make_tree(TMP "/tree", 20, 5);
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zf_compress(&dir, TMP "/a.zst", ZDECENT_COMP);
+    zf_destroy(&dir);
+
+    // the file can't be read when it is compressed, the archive is untouched
+    make_file(TMP "/tree/big.txt", 200000, 6);
+    make_file(TMP "/tree/victim.txt", 1000, 7);
+    check_crash(append_missing, NULL);
+    remove(TMP "/tree/big.txt");
+    // the archive it was written to is gone too
+    struct stat st;
+    CHECK(stat(TMP "/a.zst.tmp", &st) != 0);
+    check_archive(TMP "/a.zst", 21);
+    check_extract(TMP "/a.zst", TMP "/tree");
+}
+
+// files that need data the stream skipped, in a frame behind it
+static void test_stream_skipped(void) {
+    uint8_t data[3000];
+    fill(data, sizeof(data), 12);
+    static const char *names[] = { "a", "b", "c", "d" };
+    uint64_t offsets[] = { 2000, 1200, 100, 2100 };
+    uint64_t flens[] = { 1000, 500, 300, 200 };
+    uint8_t index[128];
+    uint8_t *p = index;
+    p += _zf_put_varint(p, 4);
+    for (int i = 0; i < 4; ++i) {
+        p += _zf_put_varint(p, 1);
+        p += _zf_put_varint(p, flens[i]);
+        p += _zf_put_varint(p, offsets[i]);
+        *p++ = names[i][0];
+        p += _zf_put_varint(p, 0);
+        p += _zf_put_varint(p, 0);
+        p += _zf_put_varint(p, 0);
+    }
+    p += _zf_put_varint(p, sizeof(data));
+    p += _zf_put_varint(p, 0);
+    p += _zf_put_varint(p, 0);
+    p += _zf_put_varint(p, 0);
+    const uint8_t *parts[3] = { data, data + 2000, index };
+    size_t lens[3] = { 2000, 1000, (size_t) (p - index) };
+    write_archive(TMP "/a.zst", parts, lens, 3);
+
+    zf_extract_stream(TMP "/a.zst", TMP "/out", true);
+    char path[64];
+    for (int i = 0; i < 4; ++i) {
+        snprintf(path, sizeof(path), "%s/out/%s", TMP, names[i]);
+        size_t len;
+        uint8_t *got = read_file(path, &len);
+        CHECK(got && len == flens[i]);
+        CHECK(memcmp(got, data + offsets[i], len) == 0);
+        free(got);
+    }
+}
+
+static void test_incremental(void) {
+    make_tree(TMP "/tree", 40, 8);
+    incremental_run(TMP "/a.zst", TMP "/a.zst", false);
+
+    // a changed file, a deleted one and a new one
+    make_file(TMP "/tree/d1/s1/f1.txt", 12345, 9);
+    remove(TMP "/tree/d2/s2/f2.txt");
+    make_file(TMP "/tree/new.txt", 777, 10);
+    incremental_run(TMP "/b.zst", TMP "/a.zst", true);
+    check_archive(TMP "/b.zst", 41);
+    check_extract(TMP "/b.zst", TMP "/tree");
+
+    // in place, the archive is replaced at the end
+    make_file(TMP "/tree/d0/s3/f3.txt", 4321, 11);
+    incremental_run(TMP "/b.zst", TMP "/b.zst", true);
+    check_archive(TMP "/b.zst", 41);
+    check_extract(TMP "/b.zst", TMP "/tree");
+    struct stat st;
+    CHECK(stat(TMP "/b.zst.tmp", &st) != 0);
+
+    // most files change every time and the few that don't are different
+    // ones, their frames are compressed again instead of piling up the
+    // old data around them
+    char path[512];
+    for (uint32_t round = 0; round < 6; ++round) {
+        for (int i = 0; i < 40; ++i) {
+            snprintf(path, sizeof(path), TMP "/tree/d%d/s%d/f%d.txt", i % 3, i % 5, i);
+            if (i % 8 != (int) round)
+                make_file(path, 400, 100 + round * 40 + (uint32_t) i);
+        }
+        incremental_run(TMP "/b.zst", TMP "/b.zst", round % 2 == 0);
+    }
+    // f2.txt is back
+    check_archive(TMP "/b.zst", 42);
+    check_extract(TMP "/b.zst", TMP "/tree");
+    incremental_run(TMP "/c.zst", TMP "/none.zst", false);
+    struct stat fresh;
+    CHECK(stat(TMP "/b.zst", &st) == 0 && stat(TMP "/c.zst", &fresh) == 0);
+    CHECK(st.st_size < fresh.st_size * 3 / 2);
+}
+
+static void compress_window(void *arg) {
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.window_log = *(int *) arg;
+    zf_compress_opt(&dir, TMP "/b.zst", &opt);
+}
+
+static void test_long_distance(void) {
+    // the same 3 MB of noise twice, too far apart for the default window of level 3
+    size_t len = 3 << 20;
+    uint8_t *noise = (uint8_t *) malloc(len);
+    CHECK(noise);
+    uint32_t x = 48;
+    for (size_t i = 0; i < len; ++i) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        noise[i] = (uint8_t) x;
+    }
+    write_file(TMP "/tree/a.bin", noise, len);
+    write_file(TMP "/tree/b.bin", noise, len);
+    free(noise);
+
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    zoptions opt = zf_default_options(ZDECENT_COMP);
+    opt.dedup = false;
+    opt.block_size = 0;
+    opt.long_distance = true;
+    opt.window_log = 28;
+    zf_compress_opt(&dir, TMP "/a.zst", &opt);
+    zf_destroy(&dir);
+
+    struct stat st;
+    CHECK(stat(TMP "/a.zst", &st) == 0 && (size_t) st.st_size < len + len / 4);
+    zf_init(&dir);
+    zf_open(&dir, TMP "/a.zst");
+    CHECK(((_zf_archive *) dir.archive)->window_log == 28);
+    zf_destroy(&dir);
+    check_archive(TMP "/a.zst", 2);
+    check_extract(TMP "/a.zst", TMP "/tree");
+
+    int bad = 5;
+    check_crash(compress_window, &bad);
+}
+
+static void test_find_file(void) {
+    make_tree(TMP "/tree", 50, 26);
+    make_file(TMP "/new.txt", 100, 27);
+    zfolder dir;
+    zf_init(&dir);
+    zf_add_dir(&dir, TMP "/tree", true);
+    // the same path twice, the first one is found
+    zf_add_file(&dir, TMP "/tree/d1/s1/f1.txt");
+    zf_compress(&dir, TMP "/a.zst", ZDECENT_COMP);
+    zf_destroy(&dir);
+
+    // the files of the archive come from the lookup table, the
+    // ones added after it are searched one by one
+    zf_init(&dir);
+    zf_open(&dir, TMP "/a.zst");
+    uint32_t nfiles = dir.nfiles;
+    zf_add_file(&dir, TMP "/new.txt");
+    for (uint32_t i = 0; i < dir.nfiles; ++i) {
+        uint32_t index;
+        const char *path = zf_get_path(&dir, i);
+        CHECK(zf_find_file(&dir, path, &index));
+        CHECK(strcmp(zf_get_path(&dir, index), path) == 0 && index <= i);
+        CHECK(index == i || i == nfiles - 1);
+    }
+    uint32_t index;
+    CHECK(!zf_find_file(&dir, TMP "/tree/missing.txt", &index));
+    CHECK(!zf_find_file(&dir, TMP "/tree/d1", &index));
+
+    // a cleared zfolder has nothing to find
+    zf_clear(&dir);
+    CHECK(!zf_find_file(&dir, TMP "/new.txt", &index));
+    zf_destroy(&dir);
+}
+
+typedef struct {
+    const char *name;
+    void (*fn)(void);
+} test_case;
+
+static const test_case tests[] = {
+    { "compress", test_compress },
+    { "zstd_workers", test_zstd_workers },
+    { "extract_file", test_extract_file },
+    { "compress_threads", test_compress_threads },
+    { "legacy", test_legacy },
+    { "get_file", test_get_file },
+    { "clear", test_clear },
+    { "many_files", test_many_files },
+    { "long_paths", test_long_paths },
+    { "large_sizes", test_large_sizes },
+    { "walk_parallel", test_walk_parallel },
+    { "walk_entries", test_walk_entries },
+    { "extract_dirs", test_extract_dirs },
+    { "extract_big", test_extract_big },
+    { "read_batches", test_read_batches },
+#ifdef Z_MMAP
+    { "mmap", test_mmap },
+#endif
+    { "lazy", test_lazy },
+    { "malformed_frames", test_malformed_frames },
+    { "dict", test_dict },
+    { "dedup", test_dedup },
+    { "chunks", test_chunks },
+    { "malformed_index", test_malformed_index },
+    { "append", test_append },
+    { "append_failed", test_append_failed },
+    { "stream_skipped", test_stream_skipped },
+    { "incremental", test_incremental },
+    { "long_distance", test_long_distance },
+    { "find_file", test_find_file },
+};
+
+int main(int argc, char **argv) {
+    // the library reports sizes on stdout
+    if (!freopen("/dev/null", "w", stdout))
+        return 1;
+    int run = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+        if (argc > 1 && !strstr(tests[i].name, argv[1]))
+            continue;
+        CHECK(system("rm -rf " TMP) == 0);
+        mkdir(TMP, 0755);
+        tests[i].fn();
+        fprintf(stderr, "ok %s\n", tests[i].name);
+        run++;
+    }
+    CHECK(system("rm -rf " TMP) == 0);
+    fprintf(stderr, "%d tests passed\n", run);
+    return 0;
+}
@@ -7,13 +7,60 @@
         #define Z_FOLDER_IMPLEMENTATION
         #include "zfolder.h"
 
+    On linux, link with -lpthread: besides the parallel functions,
+    zf_compress and zf_compress_opt start one thread per cpu by default
+    (ZAUTO_THREADS), set opt.nthreads = ZNO_THREADS to compress on the
+    calling thread like v0.1 did
+
   COMPILE TIME OPTIONS:
 
-    #define MAX_FILES [n]
-        maximum number of files in a zst file (default: 2048)
+    #define Z_MIN_FILES_CAP [n]
+        initial capacity of the file table, which then doubles every
+        time it fills up (default: 64)
+
+    #define Z_MIN_PATHS_CAP [n]
+        initial capacity of the path string pool, which then doubles
+        every time it fills up (default: 4 KB)
+
+    #define Z_BLOCK_SIZE [n]
+        default size of the independently compressed blocks (default: 1 MB)
+
+    #define Z_MIN_DATA_CAP [n]
+        initial capacity of the data buffer, which then doubles every
+        time it fills up (default: 64 KB)
+
+    #define Z_NO_DIRFD
+        on linux zf_add_dir keeps the directories open and uses
+        getdents64/openat relative to them instead of resolving the
+        full path of every file, define this to use opendir/fopen
+
+    #define Z_GETDENTS_BUF [n]
+        size of the buffer passed to getdents64 (default: 64 KB)
+
+    #define Z_IO_URING
+        on linux zf_decompress_todir submits the open/write/close of
+        many files at once with io_uring, and zf_add_dir does the same
+        with statx/open/read/close, if the kernel doesn't allow it the
+        files are read and written one at a time as usual
+
+    #define Z_URING_BATCH [n]
+        number of files submitted together with io_uring (default: 64)
 
-    #define MAX_PATH_LEN [n]
-        maximum path length (not more than 255) (default: 128)
+    #define Z_URING_MAX_FILE [n]
+        files bigger than this are read and written one at a time
+        (default: 1 MB)
+
+    #define Z_MIN_LIVE_PERCENT [n]
+        zf_compress_incremental compresses the unchanged files again
+        instead of copying their frames when less than n percent of the
+        data of one of those frames still belongs to a file, so the data
+        of changed and deleted files doesn't pile up (default: 50)
+
+    #define Z_MMAP_MIN_SIZE [n]
+        files of at least n bytes are memory mapped (with MADV_SEQUENTIAL)
+        instead of being read in the data buffer, and the compressor reads
+        them straight from the mapping, the files must not change until
+        the zfolder is cleared (posix only, default: not defined)
 
   USAGE:
 
@@ -23,6 +70,86 @@
     zf_add_file(&dir, "hello_world.txt");
     zf_add_dir(&dir, "nested/folder_name", true); // recursive: true
     zf_compress(&dir, "file.zst", ZMAX_COMP);
+    // zf_clear keeps the allocated memory around to
+    // create another archive with the same zfolder
+    zf_clear(&dir);
+    zf_add_dir(&dir, "other_folder", true);
+    zf_compress(&dir, "other.zst", ZMAX_COMP);
+    zf_destroy(&dir);
+
+    // == LAZY COMPRESSION =====================
+    // files are only stat-ed when they are added and zf_compress
+    // streams them from disk, so memory doesn't grow with their size
+    zf_init(&dir);
+    dir.lazy = true;
+    zf_add_dir(&dir, "huge_folder", true);
+    zf_compress(&dir, "huge.zst", ZMAX_COMP);
+    zf_destroy(&dir);
+
+    // == PARALLEL TRAVERSAL ===================
+    // directories are walked and files are read by multiple
+    // threads, files are added sorted by path
+    zf_add_dir_parallel(&dir, "big_folder", true, ZAUTO_THREADS);
+
+    // == PARALLEL EXTRACTION ==================
+    // files are written by multiple threads, works both after
+    // zf_decompress and after zf_open (each thread decompresses
+    // whole blocks)
+    zf_decompress_todir_parallel(&dec, "output_dir", true, ZAUTO_THREADS);
+
+    // == COMPRESSION OPTIONS ==================
+    zoptions opt = zf_default_options(ZMAX_COMP);
+    opt.nthreads = 8; // ZAUTO_THREADS (default) uses every available cpu,
+                      // each thread compresses whole blocks
+    opt.dedup = true; // default, files with the same contents are stored once
+    zf_compress_opt(&dir, "file.zst", &opt);
+
+    // == LONG DISTANCE MATCHING ===============
+    // repetitions are found up to 2^window_log bytes apart, but only
+    // inside a frame, so it needs big blocks (or a single frame), the
+    // window is stored in the archive and set up by every decompressor
+    opt.block_size = 0;
+    opt.long_distance = true;
+    opt.window_log = 30;
+    zf_compress_opt(&dir, "file.zst", &opt);
+
+    // == DICTIONARY ===========================
+    // for many small files, a dictionary is trained on them, stored
+    // in the archive and used by every block
+    opt.block_size = 16 << 10;
+    opt.dict_size = 64 << 10;
+    zf_compress_opt(&dir, "file.zst", &opt);
+
+    // == CHUNK DEDUPLICATION ==================
+    // big files are split in content defined chunks (FastCDC) and
+    // every chunk is stored once, so files that only differ in a
+    // few places cost little more than one of them
+    opt.chunk_size = 16 << 10;
+    zf_compress_opt(&dir, "file.zst", &opt);
+
+    // == APPEND ===============================
+    // the new files are compressed in frames after the ones already in
+    // the archive, which are copied as they are, a file with the same
+    // path as one in the archive replaces it (the dictionary of the
+    // archive is used, dict_size is ignored), the archive is written to
+    // file.zst.tmp and renamed over file.zst once it is complete, so a
+    // failed append leaves the old one as it was
+    zf_init(&dir);
+    zf_add_file(&dir, "new_file.txt");
+    zf_append(&dir, "file.zst", &opt);
+    zf_destroy(&dir);
+
+    // == INCREMENTAL COMPRESSION ==============
+    // the frames holding files that have the same size, modification time
+    // and inode as in the previous archive are copied as they are, only
+    // the other files are read and compressed (with lazy set, the
+    // unchanged files are never opened), the data of deleted and changed
+    // files is dropped with the frames nothing points to anymore, and
+    // frames mostly made of it are compressed again (Z_MIN_LIVE_PERCENT)
+    zf_init(&dir);
+    dir.lazy = true;
+    zf_add_dir(&dir, "folder", true);
+    zf_compress_incremental(&dir, "file.zst", "file.zst", &opt);
     zf_destroy(&dir);
 
     // == DECOMPRESSION ========================
@@ -32,6 +159,26 @@
     zf_decompress_todir(&dec, "output_dir", true); // overwrite: true
     zf_destroy(&dec);
 
+    // == LAZY DECOMPRESSION ===================
+    // only the index is read, data is decompressed when requested
+    zfolder arc;
+    zf_init(&arc);
+    zf_open(&arc, "file.zst");
+    uint32_t index;
+    if (zf_find_file(&arc, "hello_world.txt", &index))
+        puts((char *) zf_get_file(&arc, index));
+    zf_destroy(&arc);
+
+    // == STREAMING DECOMPRESSION ==============
+    // uses a few MB of memory no matter the size of the archive
+    zf_extract_stream("file.zst", "output_dir", true); // overwrite: true
+
+    // == RANDOM ACCESS ========================
+    // only decompresses the block that contains the file
+    uint64_t len;
+    uint8_t *data = zf_extract_file("file.zst", "nested/folder_name/a.txt", &len);
+    free(data);
+
   LICENSE:
     MIT License
 
@@ -59,6 +206,7 @@
 #ifndef INCLUDE_Z_FOLDER_H
 #define INCLUDE_Z_FOLDER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -66,23 +214,98 @@
 extern "C" {
 #endif
 
-#ifndef Z_MAX_FILES
-#define Z_MAX_FILES 2048
+#ifndef Z_MIN_FILES_CAP
+#define Z_MIN_FILES_CAP 64
+#endif
+
+#ifndef Z_MIN_PATHS_CAP
+#define Z_MIN_PATHS_CAP (4 << 10)
+#endif
+
+#ifndef Z_BLOCK_SIZE
+#define Z_BLOCK_SIZE (1 << 20)
 #endif
 
-#ifndef Z_MAX_PATH_LEN
-#define Z_MAX_PATH_LEN 128
+#ifndef Z_MIN_DATA_CAP
+#define Z_MIN_DATA_CAP (64 << 10)
+#endif
+
+#ifndef Z_GETDENTS_BUF
+#define Z_GETDENTS_BUF (64 << 10)
+#endif
+
+#ifndef Z_URING_BATCH
+#define Z_URING_BATCH 64
+#endif
+
+#ifndef Z_MIN_LIVE_PERCENT
+#define Z_MIN_LIVE_PERCENT 50
+#endif
+
+#ifndef Z_URING_MAX_FILE
+#define Z_URING_MAX_FILE (1 << 20)
 #endif
 
 /*
-FORMAT:
-    nfiles (4 bytes) -> number of files encoded
-    files header: (there are nfiles file headers)
-        plen (1 bytes) -> length of path string
-        flen (4 bytes) -> length of this specific file
-        path (plen bytes) -> pathname (string DOES NOT END WITH NULL)
-    dlen (4 bytes) -> length of unencoded data
-    data -> just a stream of data until the end of the file
+FORMAT: (version 6)
+    data frames: (zstd frames)
+        the data of the files, one frame for every block of consecutive
+        files, files never span two frames (a chunked file is stored as
+        chunks, a chunk never spans two frames), if there is a dictionary
+        they are compressed with it, frames kept by zf_append and
+        zf_compress_incremental can have data no file points to
+    dictionary frame: (zstd frame, only if dict is 1)
+        zstd dictionary used by the data frames
+    index frame: (zstd frame)
+        nfiles (varint) -> number of files encoded
+        files header: (there are nfiles file headers)
+            plen (varint) -> length of path string
+            flen (varint) -> length of this specific file
+            offset (varint) -> offset of the file in the data, files with
+                               the same contents share it (since version 3)
+            path (plen bytes) -> pathname (string DOES NOT END WITH NULL)
+            chunked (varint) -> 1 if the file is made of chunks, then offset
+                                is the index of its first chunk in the chunk
+                                table, and its chunks follow it until their
+                                lengths add up to flen (since version 4)
+            mtime (varint) -> modification time in nanoseconds since the
+                              epoch, 0 if unknown (since version 5)
+            ino (varint) -> inode number, 0 if unknown (since version 5)
+        dlen (varint) -> length of unencoded data (every content stored once)
+        dict (varint) -> 1 if there is a dictionary frame, 0 otherwise
+                         (not present in version 1)
+        nchunks (varint) -> number of chunks in the chunk table (since version 4)
+        chunk table: (there are nchunks entries, a chunk shared by
+                      many files has one entry for each of them)
+            offset (varint) -> offset of the chunk in the data
+            len (varint) -> length of the chunk
+        window_log (varint) -> log2 of the biggest window of the data frames,
+                               0 -> at most 2^27, the zstd default (since version 6)
+    seek table: (zstd skippable frame)
+        magic (4 bytes) -> 0x184D2A5E
+        size (4 bytes) -> size of the rest of the seek table
+        frames: (there are nframes entries, the last one is the index frame)
+            csize (varint) -> compressed size of the frame
+            dsize (varint) -> decompressed size of the frame
+        table_len (4 bytes) -> size of the frames entries
+        nframes (4 bytes) -> number of frames
+        version (1 byte) -> format version
+        magic (4 bytes) -> 0x444C465A ("ZFLD")
+
+    varints are unsigned LEB128: 7 bits per byte, least significant
+    group first, the high bit is set on every byte but the last one
+
+    the index can be read from the end of the file without
+    decompressing any of the data frames
+
+    archives without a seek table (written before version 1) are one
+    zstd stream, the values are in the byte order of the writer:
+        nfiles (4 bytes)
+        files header: (there are nfiles file headers)
+            plen (1 byte), flen (4 bytes), path (plen bytes)
+        dlen (4 bytes)
+        data -> the files one after the other
+    zf_open decompresses them whole, they can't be appended to
 */
 
 enum {
@@ -92,33 +315,122 @@ enum {
     ZMAX_COMP = 20
 } zcompression;
 
+enum {
+    ZAUTO_THREADS = -1, // one worker for every cpu the process can run on
+    ZNO_THREADS = 0,    // compress on the calling thread
+};
+
+typedef struct {
+    int    level;       // compression level
+    int    nthreads;    // threads compressing blocks at the same time (or ZAUTO_THREADS),
+                        // a single frame is split between zstd workers instead
+    size_t job_size;    // bytes compressed by each zstd worker job, 0 -> zstd default
+    int    overlap_log; // data reloaded between jobs (1-9), 0 -> zstd default
+    size_t block_size;  // files are grouped in independent frames of up to
+                        // block_size bytes, 0 -> a single frame for all files
+    size_t dict_size;   // train a dictionary of up to dict_size bytes on the
+                        // files and compress every frame with it, 0 -> none
+    bool   dedup;       // store files with the same contents only once
+    size_t chunk_size;  // split the files bigger than chunk_size in content defined
+                        // chunks of about chunk_size bytes (at least 64) and store
+                        // every chunk only once, 0 -> files are stored whole
+    bool   long_distance; // long distance matching, finds repetitions far apart
+                          // in a frame (the window is 2^27 bytes if not set)
+    int    window_log;  // log2 of the window size (10-31), 0 -> zstd default
+} zoptions;
+
+enum {
+    ZFILE_DATA = 0, // the file is in the data buffer, at offset
+    ZFILE_MAPPED,   // the file has its own buffer (memory mapped, or loaded from
+                    // disk by zf_get_file), offset is the index of the buffer
+    ZFILE_DISK,     // the file is only on disk, at its path (added with lazy set)
+    ZFILE_CHUNKED,  // the file is made of chunks of the data (read from an archive),
+                    // offset is the index of its first chunk
+};
+
+// largest fields first, so there is no padding between them
 typedef struct {
-    char     path[Z_MAX_PATH_LEN];
-    uint8_t  plen; // path length
-    uint32_t flen; // file length
+    uint64_t flen;   // file length
+    uint64_t offset; // offset of the file in the data
+    uint64_t mtime;  // modification time in nanoseconds, 0 if unknown
+    uint64_t ino;    // inode number, 0 if unknown
+    uint32_t path;   // offset of the path in the path pool
+    uint16_t plen;   // path length
+    uint8_t  source; // where the data of the file is (ZFILE_DATA, ZFILE_MAPPED, ZFILE_DISK, ZFILE_CHUNKED)
 } zfile;
 
 typedef struct {
-    zfile    files[Z_MAX_FILES];
-    uint32_t nfiles; // number of files
+    zfile   *files;
+    uint32_t nfiles;  // number of files
+    size_t   fcap;    // files capacity
+    char    *paths;   // path pool, every path ends with \0
+    size_t   pathlen; // path pool length
+    size_t   pathcap; // path pool capacity
     uint8_t *data;
-    uint32_t dlen;   // data length
+    uint64_t dlen;    // data length
+    size_t   dcap;    // data capacity
+    void    *archive; // set by zf_open, used to read file data lazily
+    void    *maps;    // buffers of the ZFILE_MAPPED files
+    uint32_t nmaps;   // number of buffers
+    size_t   mapcap;  // buffers capacity
+    void    *chunks;  // chunks of the ZFILE_CHUNKED files
+    uint32_t nchunks; // number of chunks
+    size_t   ccap;    // chunks capacity
+    uint32_t *lookup; // file indices by path (open addressing), set by zf_open
+    uint32_t nlookup; // files in lookup, the ones added later aren't
+    size_t   lookcap; // lookup capacity, a power of 2
+    bool     lazy;    // if set, adding a file only records its path and size,
+                      // the contents are read from disk by zf_compress
 } zfolder;
 
 // initialize zfolder object
 void zf_init(zfolder *dir);
 // add a file to the zfolder
-void zf_add_file(zfolder *dir, const char path[Z_MAX_PATH_LEN]);
+void zf_add_file(zfolder *dir, const char *path);
 // add an entire directory to the zfolder
 void zf_add_dir(zfolder *dir, const char *path, bool recursive);
+// add an entire directory to the zfolder, walking it and reading the files
+// with nthreads threads (or ZAUTO_THREADS), files are added sorted by path
+void zf_add_dir_parallel(zfolder *dir, const char *path, bool recursive, int nthreads);
 // compress the zfolder
 void zf_compress(zfolder *dir, const char *path, int compression_level);
+// compress the zfolder using the options
+void zf_compress_opt(zfolder *dir, const char *path, const zoptions *opt);
+// add the files of the zfolder to the archive at path (creating it if it doesn't
+// exist), only the new files are compressed, a file with the same path as one
+// in the archive replaces it
+void zf_append(zfolder *dir, const char *path, const zoptions *opt);
+// compress the files of dir to path, copying the compressed data of the files that
+// didn't change since the archive previous was made (same path, size, modification
+// time and inode) instead of reading them, previous can be path itself
+void zf_compress_incremental(zfolder *dir, const char *path, const char *previous, const zoptions *opt);
+// get the default options for the compression level
+zoptions zf_default_options(int compression_level);
 // decompress the file
 void zf_decompress(zfolder *dir, const char *fname);
+// open the file reading only the index, the data of a file is
+// decompressed the first time it is requested with zf_get_file
+void zf_open(zfolder *dir, const char *fname);
 // decompress the zfolder to the (output) directory
 void zf_decompress_todir(zfolder *dir, const char *output, bool overwrite);
-// get file, returns the data
+// decompress the zfolder to the (output) directory, writing the files
+// with nthreads threads (or ZAUTO_THREADS)
+void zf_decompress_todir_parallel(zfolder *dir, const char *output, bool overwrite, int nthreads);
+// decompress the file straight to the (output) directory, without loading
+// it in memory, files are written as their bytes are decompressed
+void zf_extract_stream(const char *fname, const char *output, bool overwrite);
+// decompress only the block containing the file at path, returns the
+// allocated file data (or NULL if the file isn't in the archive)
+uint8_t *zf_extract_file(const char *fname, const char *path, uint64_t *len);
+// get file, returns the data (a file added with lazy set is read from disk)
 uint8_t *zf_get_file(zfolder *dir, uint32_t index);
+// get the path of a file
+const char *zf_get_path(zfolder *dir, uint32_t index);
+// find the index of the file with this path, returns false if there is none,
+// the files read by zf_open are hashed, the ones added later are scanned
+bool zf_find_file(zfolder *dir, const char *path, uint32_t *index);
+// remove every file but keep the memory, so the zfolder can be reused
+void zf_clear(zfolder *dir);
 // destroy the zfolder object
 void zf_destroy(zfolder *dir);
 
@@ -145,15 +457,70 @@ void zf_destroy(zfolder *dir);
 #include <stdio.h>  // fprintf FILE
 #include <stdlib.h> // malloc realloc free
 #include <string.h> // memcpy strcpy strncpy strnlen strlen
+#include <errno.h>  // errno
 #include <dirent.h> // DIR
 
 #include <sys/stat.h> // stat
+#include <sys/types.h> // off_t
 
 #ifdef Z_WINDOWS
-#include <direct.h> // _mkdir
+#include <direct.h>  // _mkdir
+#include <windows.h> // GetSystemInfo CreateThread
+#elif defined(Z_LINUX)
+#include <unistd.h>  // sysconf
+#include <pthread.h> // pthread_create
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h> // SYS_sched_getaffinity SYS_getdents64
+#endif
+
+#if defined(__linux__) && !defined(Z_NO_DIRFD)
+#define Z_DIRFD
+#include <fcntl.h>       // open openat
+#endif
+
+#if defined(Z_LINUX) && defined(Z_MMAP_MIN_SIZE)
+#define Z_MMAP
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap madvise
 #endif
 
-#include <zstd.h> // zstandard compression
+#if defined(__linux__) && defined(Z_IO_URING)
+#define Z_URING
+#include <fcntl.h>            // AT_FDCWD
+#include <sys/mman.h>         // mmap
+#include <sys/syscall.h>      // __NR_io_uring_setup
+#include <linux/io_uring.h>   // io_uring_params
+#include <linux/stat.h>       // statx
+#endif
+
+
+#include <zstd.h>  // zstandard compression
+#include <zdict.h> // ZDICT_trainFromBuffer
+
+// 64 bit offsets even where long is 32 bits
+#ifdef Z_WINDOWS
+#define z_fseek _fseeki64
+#define z_ftell _ftelli64
+#define z_stat  _stat64
+#define z_lstat _stat64
+#define z_mtime(st) ((uint64_t) (st).st_mtime * 1000000000)
+typedef int64_t z_off_t;
+typedef struct _stat64 z_stat_t;
+#else
+#define z_fseek fseeko
+#define z_ftell ftello
+#define z_stat  stat
+#define z_lstat lstat
+#ifdef __linux__
+#define z_mtime(st) ((uint64_t) (st).st_mtim.tv_sec * 1000000000 + (uint64_t) (st).st_mtim.tv_nsec)
+#else
+#define z_mtime(st) ((uint64_t) (st).st_mtime * 1000000000)
+#endif
+typedef off_t z_off_t;
+typedef struct stat z_stat_t;
+#endif
 
 // == DEFINES ===================================================
 
@@ -166,15 +533,591 @@ void zf_destroy(zfolder *dir);
 #define nread_from_buf(buf, data, n) do { memcpy(&(data), (buf), (n)); (buf) += (n); } while(0);
 #define read_from_buf(buf, data) nread_from_buf(buf, data, sizeof(data))
 
+#define Z_SKIPPABLE_MAGIC  (ZSTD_MAGIC_SKIPPABLE_START | 0xE)
+#define Z_FORMAT_MAGIC     0x444C465A
+#define Z_FORMAT_VERSION   6
+// table_len + nframes + version + magic
+#define Z_SEEK_FOOTER_SIZE 13
+// a 64 bit varint takes at most 10 bytes
+#define Z_MAX_VARINT_SIZE  10
+// biggest window zstd decompresses without being told
+// (ZSTD_WINDOWLOG_LIMIT_DEFAULT, only in the static API)
+#define Z_DEFAULT_WINDOW_LOG 27
+// biggest read or write done with a single call
+#define Z_IO_CHUNK         (64 << 20)
+
 // == STATIC FUNCTIONS ==========================================
 
-static uint32_t _zf_read_file(const char *path, zfolder *dir);
-static uint32_t _read_whole_file(const char *fname, uint8_t **data);
-static void _write_whole_file(const char *path, uint8_t *data, size_t dlen);
+// streaming compressor, the input is staged in a buffer of
+// ZSTD_CStreamInSize bytes and the output is written to the file
+// in chunks of ZSTD_CStreamOutSize bytes
+typedef struct {
+    ZSTD_CCtx *cctx;
+    FILE     *f;
+    uint8_t  *in;
+    size_t    in_len;
+    size_t    in_cap;
+    uint8_t  *out;
+    size_t    out_cap;
+    uint64_t  written; // compressed bytes written to f
+    uint64_t  start;   // value of written when the frame began
+} _zf_cstream;
+
+static void _zf_cstream_init(_zf_cstream *s, FILE *f, const zoptions *opt);
+static void _zf_cstream_begin(_zf_cstream *s, uint64_t src_len);
+static void _zf_cstream_write(_zf_cstream *s, const void *data, size_t len);
+static void _zf_cstream_varint(_zf_cstream *s, uint64_t value);
+static uint64_t _zf_cstream_end(_zf_cstream *s);
+static void _zf_cstream_free(_zf_cstream *s);
+// copy len bytes of src to the frame, reading them straight into the staging buffer
+static void _zf_cstream_copy(_zf_cstream *s, FILE *src, uint64_t len, const char *path);
+static void _zf_cstream_feed(_zf_cstream *s, const void *data, size_t len, ZSTD_EndDirective mode);
+
+// streaming decompressor, decompressed bytes are kept in a buffer of
+// ZSTD_DStreamOutSize bytes until they are consumed
+typedef struct {
+    ZSTD_DCtx     *dctx;
+    FILE          *f;
+    uint8_t       *in;
+    size_t         in_cap;
+    ZSTD_inBuffer  input;
+    uint8_t       *out;
+    size_t         out_cap;
+    size_t         out_pos; // first byte that wasn't consumed yet
+    size_t         out_len; // number of decompressed bytes in out
+} _zf_dstream;
+
+static void _zf_dstream_init(_zf_dstream *s, FILE *f);
+static void _zf_dstream_read(_zf_dstream *s, void *data, size_t len);
+static void _zf_dstream_copy(_zf_dstream *s, FILE *dst, uint64_t len);
+static void _zf_dstream_free(_zf_dstream *s);
+static void _zf_dstream_skip(_zf_dstream *s, uint64_t len);
+static bool _zf_dstream_fill(_zf_dstream *s);
+
+// entry of the seek table
+typedef struct {
+    uint64_t csize; // compressed size
+    uint64_t dsize; // decompressed size
+} _zf_frame;
+
+static void _zf_write_seek_table(FILE *f, _zf_frame *frames, uint32_t nframes);
+static uint32_t _zf_read_seek_table(FILE *f, _zf_frame **frames, uint8_t *version);
+// train a dictionary on samples of the files, returns NULL if it isn't possible
+static uint8_t *_zf_train_dict(zfolder *dir, size_t dict_size, size_t *dict_len);
+
+// 128 bit MurmurHash3 (x64 variant)
+typedef struct {
+    uint64_t h1, h2;
+} _zf_hash;
+
+static uint64_t _zf_rotl64(uint64_t x, int r);
+static uint64_t _zf_fmix64(uint64_t k);
+// len has to be a multiple of 16 in every call but the last one
+static void _zf_hash_update(_zf_hash *h, const uint8_t *data, size_t len);
+static _zf_hash _zf_hash_end(_zf_hash h, uint64_t total_len);
+static _zf_hash _zf_hash_file(zfolder *dir, uint32_t index);
+
+typedef struct {
+    uint64_t flen;
+    _zf_hash hash;
+    uint32_t index;
+} _zf_dedup_entry;
+
+// by length, then by index
+static int _zf_dedup_len_cmp(const void *a, const void *b);
+// by hash, then by index
+static int _zf_dedup_hash_cmp(const void *a, const void *b);
+// sets orig[i] to the first file with the same contents as file i, or to i
+// itself if there is none before it, returns the number of duplicates
+static uint32_t _zf_dedup(zfolder *dir, uint32_t *orig);
+// files a and b (of the same length) have the same bytes
+static bool _zf_same_contents(zfolder *dir, uint32_t a, uint32_t b);
+
+// part of the data of a ZFILE_CHUNKED file
+typedef struct {
+    uint64_t offset; // offset in the data
+    uint64_t len;
+} _zf_chunk;
+
+// part of a file that is compressed, the data is made of pieces one after the other
+typedef struct {
+    uint32_t file;
+    uint64_t offset; // offset in the file
+    uint64_t len;
+} _zf_piece;
+
+// where the files go in the data
+typedef struct {
+    _zf_piece *pieces;   // the data in order
+    uint32_t   npieces;
+    size_t     piececap;
+    _zf_chunk *chunks;   // chunk table of the index
+    uint32_t   nchunks;
+    size_t     chunkcap;
+    uint64_t  *offsets;  // offset of every file in the data, or of its first chunk
+    bool      *chunked;  // the file is made of chunks
+    uint64_t   dlen;     // length of the data
+} _zf_layout;
+
+// unique chunks, open addressing on the hash
+typedef struct {
+    _zf_hash hash;
+    uint64_t offset; // offset in the data
+    uint64_t len;    // 0 -> empty slot
+    uint32_t file;   // where its bytes are read from to compare them
+    uint64_t foffset;
+} _zf_chunk_slot;
+
+typedef struct {
+    _zf_chunk_slot *slots;
+    size_t          cap;
+    size_t          count;
+} _zf_chunk_set;
+
+// reads parts of files, a lazy file stays open between reads
+typedef struct {
+    zfolder *dir;
+    FILE    *f;
+    uint32_t index;
+    uint8_t *buf;
+    size_t   cap;
+} _zf_range_reader;
+
+// len bytes at offset of the file, valid until the next read
+static const uint8_t *_zf_range_read(_zf_range_reader *r, uint32_t index, uint64_t offset, size_t len);
+
+// lays out every file that isn't a duplicate, the ones bigger than chunk_size
+// are split in chunks (if chunk_size isn't 0) and only new chunks are stored
+static void _zf_layout_build(_zf_layout *l, zfolder *dir, const uint32_t *orig, size_t chunk_size);
+static void _zf_layout_free(_zf_layout *l);
+
+// fill dir->lookup with every file, for zf_find_file
+static void _zf_index_paths(zfolder *dir);
+// slot of the file with this path in dir->lookup, or the empty slot where it goes
+static uint32_t *_zf_path_slot(zfolder *dir, const char *path, size_t len);
+
+// archive whose files are kept by zf_append and zf_compress_incremental
+typedef struct {
+    zfolder    *dir;      // its index
+    bool       *keep;     // its files that are kept
+    bool       *skip;     // files of the zfolder kept from the archive instead, NULL -> none
+    _zf_frame  *frames;   // its data frames
+    uint32_t    nframes;
+    uint64_t   *coffsets; // where its frames start
+    const char *src;      // path of the archive the frames used by the kept files are
+                          // copied from, NULL -> they are already in the output file
+    uint8_t    *dict;     // its dictionary, NULL if it has none
+    size_t      dict_len;
+    int         window_log; // window of its data frames
+    // set by _zf_base_prepare
+    bool       *used;     // frames that hold data of a kept file
+    uint64_t   *offsets;  // offset of every kept file in the used frames
+    _zf_chunk  *chunks;   // chunks of the kept files, in the used frames
+    uint32_t    nchunks;
+    size_t      chunkcap;
+    uint64_t    dlen;     // data length of the used frames
+} _zf_base;
+
+// open the archive at path as the base, with every file kept
+// returns false if the archive has no seek table (old has all its data then)
+static bool _zf_base_open(_zf_base *base, zfolder *old, const char *path);
+// only the frames used by the kept files stay, then the offsets
+// of the kept files and chunks are moved to match
+static void _zf_base_prepare(_zf_base *base);
+static void _zf_base_use(_zf_base *base, const uint64_t *doffsets, uint64_t offset, uint64_t len);
+// the kept files in frames where less than Z_MIN_LIVE_PERCENT of the data
+// belongs to a kept file are compressed again from dir, the frames go away
+static void _zf_base_drop_sparse(_zf_base *base, zfolder *dir);
+static void _zf_base_live(_zf_base *base, const uint64_t *doffsets, uint64_t *live, uint64_t offset, uint64_t len);
+static bool _zf_base_touches(_zf_base *base, const uint64_t *doffsets, const bool *sparse, uint64_t offset, uint64_t len);
+static uint64_t _zf_base_move(_zf_base *base, const uint64_t *doffsets, const uint64_t *moved, uint64_t offset);
+static void _zf_base_free(_zf_base *base);
+// last frame that starts at or before offset, nframes if there are none
+static uint32_t _zf_frame_at(const uint64_t *doffsets, uint32_t nframes, uint64_t offset);
+// write the archive of the files of dir to f, after the frames of base (if not NULL)
+static void _zf_compress_to(zfolder *dir, FILE *f, const zoptions *opt, _zf_base *base);
+// index entries, the ones kept from base first, returns their length and
+// only computes it if s is NULL
+static uint64_t _zf_write_entry(_zf_cstream *s, zfolder *dir, uint32_t index, uint64_t offset, bool chunked);
+static uint64_t _zf_write_entries(_zf_cstream *s, zfolder *dir, _zf_layout *l, _zf_base *base);
+static uint64_t _zf_write_chunk_table(_zf_cstream *s, _zf_layout *l, _zf_base *base);
+// strcmp of two char pointers (or structs that start with one)
+static int _zf_path_cmp(const void *a, const void *b);
+static void _zf_layout_piece(_zf_layout *l, uint32_t file, uint64_t offset, uint64_t len);
+// returns the slot of the chunk, len is 0 if the chunk is new
+static _zf_chunk_slot *_zf_chunk_find(_zf_chunk_set *set, _zf_hash hash, uint64_t len);
+// FastCDC gear table
+static void _zf_cdc_gear(uint64_t *gear);
+// length of the next content defined chunk of data, between avg / 4 and avg * 8
+static size_t _zf_cdc_cut(const uint8_t *data, size_t len, size_t avg, const uint64_t *gear);
+// data at offset, in the data buffer or in the block of the open archive
+static uint8_t *_zf_data_at(zfolder *dir, uint64_t offset);
+// put the chunks of a ZFILE_CHUNKED file together in a buffer of its own
+static void _zf_load_chunks(zfolder *dir, uint32_t index);
+// write the file at path, a ZFILE_CHUNKED file is written a chunk at a time
+static void _zf_write_file(zfolder *dir, uint32_t index, const char *path);
+
+// part of the data already written to an output file by zf_extract_stream
+typedef struct {
+    uint64_t offset;  // offset in the data
+    uint64_t len;
+    uint32_t file;    // output file that has it
+    uint64_t foffset; // offset in the output file
+} _zf_extent;
+
+typedef struct {
+    zfolder     *dir;
+    _zf_dstream *stream;
+    const char  *output;
+    size_t       outlen;
+    uint64_t     position; // offset of the stream in the data
+    _zf_extent  *extents;
+    uint32_t     nextents;
+    size_t       extcap;
+    char        *path;
+    size_t       cap;
+    const char  *fname;
+    // second stream over the archive for data the first one skipped
+    FILE        *back_f;
+    _zf_dstream  back;
+    uint32_t     back_frame;
+    uint64_t     back_position;
+} _zf_stream_extract;
+
+// write len bytes of data at offset to out, at foffset of file index, they're
+// either the next bytes in the stream or bytes already written to a file
+static void _zf_stream_piece(_zf_stream_extract *sx, FILE *out, uint32_t index, uint64_t foffset, uint64_t offset, uint64_t len);
+
+// archive opened with zf_open
+typedef struct {
+    FILE       *f;
+    _zf_frame  *frames;   // data frames, the index frame is not included
+    uint32_t    nframes;
+    uint64_t   *coffsets; // offset of every frame in the file
+    uint64_t   *doffsets; // offset of every frame in the data
+    uint8_t   **blocks;   // decompressed frames, NULL until requested
+    ZSTD_DDict *ddict;    // dictionary of the data frames, NULL if there is none
+    ZSTD_DCtx  *dctx;     // used to decompress the blocks
+    int         window_log; // window of the data frames, 0 -> at most the default
+} _zf_archive;
+
+// returns true if the archive has a dictionary frame
+static bool _zf_read_index(_zf_archive *ar, _zf_frame *index, zfolder *dir, uint8_t version);
+// decompress a whole archive without a seek table (before version 1) from f
+static void _zf_read_legacy(zfolder *dir, FILE *f);
+static void _zf_archive_load_dict(_zf_archive *ar);
+// dictionary and window of the archive, only streaming decompression
+// checks the window, single calls know the size of the whole frame
+static void _zf_archive_dctx(_zf_archive *ar, ZSTD_DCtx *dctx);
+static uint32_t _zf_archive_find_frame(_zf_archive *ar, uint64_t offset);
+static void _zf_archive_check(_zf_archive *ar, zfolder *dir);
+static uint8_t *_zf_archive_block(_zf_archive *ar, uint32_t frame);
+static void _zf_archive_close(_zf_archive *ar);
+
+static zfile *_zf_new_file(zfolder *dir, const char *path);
+// size, modification time and inode of a file
+static void _zf_set_stat(zfile *file, const z_stat_t *st);
+
+// buffer of a ZFILE_MAPPED file
+typedef struct {
+    void    *ptr;
+    uint64_t len;
+    bool     mapped; // memory mapped, otherwise allocated with malloc
+} _zf_map;
+
+static uint32_t _zf_push_map(zfolder *dir, void *ptr, uint64_t len, bool mapped);
+// read a ZFILE_DISK file in a buffer of its own
+static void _zf_load_file(zfolder *dir, uint32_t index);
+#ifdef Z_MMAP
+// map the file open as fd instead of reading it (file->flen must be set),
+// returns false if it's too small or it couldn't be mapped, in which case
+// it has to be read as usual
+static bool _zf_map_fd(zfolder *dir, zfile *file, int fd);
+#endif
+static uint64_t _zf_read_file(const char *path, zfolder *dir);
+static void _zf_reserve(zfolder *dir, uint64_t len);
+static void _zf_reserve_files(zfolder *dir, uint32_t count);
+static void _zf_reserve_paths(zfolder *dir, size_t len);
+static uint32_t _zf_push_path(zfolder *dir, const char *path, size_t len);
+static void *_zf_grow(void *ptr, size_t *cap, size_t needed, size_t min_cap, size_t size);
+static char *_zf_path_buf(char *buf, size_t *cap, size_t len);
+static void _write_whole_file(const char *path, uint8_t *data, uint64_t dlen);
+// copy len bytes at offset of the src file to out
+static void _zf_copy_range(const char *src, uint64_t offset, FILE *out, uint64_t len);
+// path + ".tmp", where an archive is written before it replaces path,
+// it is removed if the program exits (a crash) before _zf_temp_replace
+static char *_zf_temp_path(const char *path);
+// rename tmp over path and free it
+static void _zf_temp_replace(char *tmp, const char *path);
+static void _zf_temp_cleanup(void);
+static void _zf_fread(FILE *f, void *data, uint64_t len);
+static void _zf_fwrite(FILE *f, const void *data, uint64_t len);
+static uint64_t _zf_file_size(FILE *f);
+static size_t _zf_put_varint(uint8_t *buf, uint64_t value);
+static uint64_t _zf_get_varint(uint8_t **buf, uint8_t *end);
+static size_t _zf_varint_size(uint64_t value);
 static void _concat_path(char *dst, const char *dir, const char *path, size_t path_length);
-static uint8_t _split_path(const char **path);
-static void _create_necessary_dirs(const char *path);
+// directory prefix of a path in the pool
+typedef struct {
+    const char *path;
+    size_t      len;
+} _zf_dirname;
+
+// create every directory needed by the files of dir inside output, each one
+// is created once, in sorted order so that parents come before children
+static void _zf_create_dirs(zfolder *dir, const char *output, size_t outlen);
+static int _zf_dirname_cmp(const void *a, const void *b);
 static void _create_dir(const char *path);
+static int _zf_cpu_count(void);
+
+#ifdef Z_URING
+// == IO_URING ==================================================
+
+// minimal io_uring, set up with the raw syscalls so that
+// liburing isn't needed
+typedef struct {
+    int       fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    unsigned  tail;    // local sq tail, published by _zf_uring_submit
+    unsigned  queued;  // sqes not submitted yet
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sq_ptr;
+    void     *cq_ptr;
+    size_t    sq_size;
+    size_t    cq_size;
+    size_t    sqes_size;
+} _zf_uring;
+
+// returns false if io_uring or one of the nops operations in ops can't be used,
+// nfiles direct descriptors are registered for the linked open/io/close
+static bool _zf_uring_init(_zf_uring *ring, unsigned entries, unsigned nfiles, const uint8_t *ops, unsigned nops);
+// the kernel knows every operation in ops
+static bool _zf_uring_supports(_zf_uring *ring, const uint8_t *ops, unsigned nops);
+// open, read and close /dev/null through a direct descriptor, returns
+// false if the kernel doesn't support them
+static bool _zf_uring_direct(_zf_uring *ring);
+static void _zf_uring_free(_zf_uring *ring);
+static struct io_uring_sqe *_zf_uring_sqe(_zf_uring *ring);
+// submit the queued sqes and wait for wait_nr completions
+static void _zf_uring_submit(_zf_uring *ring, unsigned wait_nr);
+// pop a completion, returns false if there is none
+static bool _zf_uring_cqe(_zf_uring *ring, struct io_uring_cqe *cqe);
+// submit the queued sqes and wait for count completions
+static void _zf_uring_wait(_zf_uring *ring, struct io_uring_cqe *cqes, unsigned count);
+// returns false if the files must be written with stdio
+static bool _zf_uring_write_files(zfolder *dir, const char *output, size_t outlen);
+#endif
+
+#ifdef Z_DIRFD
+// layout of the records returned by getdents64
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} _zf_dirent64;
+
+// state of zf_add_dir, path holds the full path of the current directory
+// and is only used to name the files, everything else is resolved relative
+// to the directory fd
+typedef struct {
+    zfolder  *dir;
+    char     *path;
+    size_t    cap;
+    bool      recursive;
+#ifdef Z_URING
+    bool      use_ring;
+    _zf_uring ring;
+    uint32_t  batch[Z_URING_BATCH]; // files added but not read yet
+    unsigned  nbatch;
+    struct statx stx[Z_URING_BATCH];
+#endif
+} _zf_dirwalk;
+
+// walk the directory open as fd, its path is len bytes long
+static void _zf_add_dir_at(_zf_dirwalk *w, int fd, size_t len);
+static void _zf_read_fd(int fd, uint8_t *data, uint64_t len, const char *path);
+#ifdef Z_URING
+// statx, then open, read and close every file of the batch in the
+// directory open as fd, with two submissions for the whole batch
+static void _zf_dirwalk_flush(_zf_dirwalk *w, int fd, size_t len);
+#endif
+#endif
+
+// entries of a directory, read with getdents64 on its fd when Z_DIRFD
+// is set, with readdir otherwise
+typedef struct {
+    char    *path; // the directory followed by '/', without Z_DIRFD
+                   // the name of an entry goes after it to stat it
+    size_t   plen;
+    size_t   cap;
+#ifdef Z_DIRFD
+    int      fd;
+    bool     own_fd; // opened by _zf_dirents_open, closed with the rest
+    uint8_t *buf;
+    long     len;    // bytes returned by the last getdents64
+    long     pos;    // next record in buf
+#else
+    DIR     *d;
+#endif
+} _zf_dirents;
+
+static void _zf_dirents_open(_zf_dirents *d, const char *path);
+#ifdef Z_DIRFD
+// the directory is open as fd, it stays open after _zf_dirents_close
+static void _zf_dirents_at(_zf_dirents *d, int fd, const char *path);
+#endif
+// next file or directory, NULL at the end, "." and ".." and the other
+// types are skipped, when the filesystem doesn't fill d_type the type
+// comes from _zf_dirents_stat
+static const char *_zf_dirents_next(_zf_dirents *d, unsigned char *type);
+// stat of an entry without following symlinks, relative to the directory
+// fd with Z_DIRFD, returns false if it failed
+static bool _zf_dirents_stat(_zf_dirents *d, const char *name, z_stat_t *st);
+static void _zf_dirents_close(_zf_dirents *d);
+
+#ifdef Z_WINDOWS
+typedef CRITICAL_SECTION _zf_mutex;
+typedef CONDITION_VARIABLE _zf_cond;
+#else
+typedef pthread_mutex_t _zf_mutex;
+typedef pthread_cond_t _zf_cond;
+#endif
+
+static void _zf_mutex_init(_zf_mutex *m);
+static void _zf_mutex_lock(_zf_mutex *m);
+static void _zf_mutex_unlock(_zf_mutex *m);
+static void _zf_mutex_free(_zf_mutex *m);
+static void _zf_cond_init(_zf_cond *c);
+// m has to be locked, it is locked again when the wait returns
+static void _zf_cond_wait(_zf_cond *c, _zf_mutex *m);
+static void _zf_cond_signal(_zf_cond *c);
+static void _zf_cond_broadcast(_zf_cond *c);
+static void _zf_cond_free(_zf_cond *c);
+// run fn on nthreads threads (the calling thread is one of them), the i-th
+// thread gets args + i * arg_size, returns when all of them are done
+static void _zf_run_threads(int nthreads, void *(*fn)(void *), void *args, size_t arg_size);
+
+// == PARALLEL TRAVERSAL ========================================
+
+// regular file found while walking a directory
+typedef struct {
+    char    *path;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t ino;
+} _zf_entry;
+
+// work stealing deque of directories, the owner pushes and pops
+// at the tail (depth first), other walkers steal from the head
+typedef struct {
+    _zf_mutex lock;
+    char    **dirs;
+    size_t    head;
+    size_t    tail;
+    size_t    cap;
+} _zf_deque;
+
+typedef struct _zf_walk _zf_walk;
+
+typedef struct {
+    _zf_walk  *walk;
+    int        id;
+    _zf_deque  deque;
+    _zf_entry *entries;
+    size_t     nentries;
+    size_t     cap;
+} _zf_walker;
+
+struct _zf_walk {
+    _zf_walker *walkers;
+    int         nwalkers;
+    bool        recursive;
+    _zf_mutex   lock;
+    _zf_cond    wake;    // idle walkers wait on it for a push or the end
+    size_t      pending; // directories pushed but not walked yet
+    uint64_t    pushes;  // directories pushed so far
+    zfolder    *dir;
+    uint32_t    next;    // next file to read
+    uint32_t    end;     // one past the last file to read
+};
+
+static void _zf_deque_push(_zf_deque *q, char *path);
+static char *_zf_deque_pop(_zf_deque *q);
+static char *_zf_deque_steal(_zf_deque *q);
+static void _zf_walk_push(_zf_walker *w, char *path);
+static void _zf_walk_dir(_zf_walker *w, const char *path);
+static void *_zf_walk_worker(void *arg);
+static void *_zf_read_worker(void *arg);
+static int _zf_entry_cmp(const void *a, const void *b);
+
+// == PARALLEL EXTRACTION =======================================
+
+typedef struct {
+    zfolder    *dir;
+    const char *output;
+    size_t      outlen;
+    _zf_mutex   lock;     // guards next and the archive file
+    uint32_t    next;     // next job
+    uint32_t    njobs;    // files, or frames if the archive is open
+    uint32_t   *order;    // files grouped by frame (only with an archive)
+    uint32_t   *first;    // first file of every frame in order
+} _zf_extract;
+
+typedef struct {
+    _zf_extract *ex;
+    ZSTD_DCtx   *dctx;
+    char        *path;
+    size_t       cap;
+} _zf_extractor;
+
+static void *_zf_extract_worker(void *arg);
+static void _zf_extract_write(_zf_extractor *w, uint32_t index, const uint8_t *data);
+// decompress the frame into block, lock (if not NULL) is held while reading the archive
+static void _zf_archive_load(_zf_archive *ar, uint32_t frame, uint8_t *block, ZSTD_DCtx *dctx, _zf_mutex *lock);
+
+// consecutive pieces compressed to a frame by one of the threads
+typedef struct {
+    uint32_t first;   // first piece
+    uint32_t last;    // one past the last piece
+    uint64_t len;
+    uint8_t *out;     // the compressed frame
+    size_t   out_len;
+    size_t   out_cap;
+} _zf_cblock;
+
+typedef struct {
+    zfolder        *dir;
+    _zf_piece      *pieces;
+    const uint8_t **data;    // data of every piece in memory, NULL -> it is read from disk
+    _zf_cblock     *blocks;
+    uint32_t        nblocks;
+    _zf_mutex       lock;    // guards next
+    uint32_t        next;    // next block
+} _zf_cbatch;
+
+typedef struct {
+    _zf_cbatch *batch;
+    ZSTD_CCtx  *cctx;
+    uint8_t    *in;        // the pieces of a block that aren't in memory in one piece
+    size_t      in_cap;
+    FILE       *src;       // file of the last piece read from disk
+    uint32_t    src_index;
+} _zf_compressor;
+
+// the options that change the frames, the same for every context
+static void _zf_cctx_params(ZSTD_CCtx *cctx, const zoptions *opt);
+static void *_zf_compress_worker(void *arg);
+// compress the blocks of the batch on up to nthreads threads, then
+// write them to the stream in order and add them to the frames
+static void _zf_cbatch_run(_zf_cbatch *b, _zf_compressor *workers, int nthreads, _zf_cstream *s, _zf_frame *frames, uint32_t *nframes);
 
 // == FUNCTIONS =================================================
 
@@ -182,123 +1125,404 @@ void zf_init(zfolder *dir) {
     memset(dir, 0, sizeof(zfolder));
 }
 
-void zf_add_file(zfolder *dir, const char path[Z_MAX_PATH_LEN]) {
-    zfile *current = &dir->files[dir->nfiles++];
-    strncpy(current->path, path, Z_MAX_PATH_LEN);
-    // should never be more than Z_MAX_PATH_LEN anyway
-    current->plen = (uint8_t) strnlen(current->path, Z_MAX_PATH_LEN);
+void zf_add_file(zfolder *dir, const char *path) {
+    zfile *current = _zf_new_file(dir, path);
+    z_stat_t st;
+    if (z_stat(path, &st) != 0)
+        crashfmt("couldn't stat file -> %s", path);
+    _zf_set_stat(current, &st);
+    if (dir->lazy) {
+        current->offset = 0;
+        current->source = ZFILE_DISK;
+        return;
+    }
+#ifdef Z_MMAP
+    if (current->flen >= Z_MMAP_MIN_SIZE) {
+        int fd = open(path, O_RDONLY);
+        bool mapped = fd >= 0 && _zf_map_fd(dir, current, fd);
+        if (fd >= 0)
+            close(fd);
+        if (mapped)
+            return;
+    }
+#endif
+    current->offset = dir->dlen;
     current->flen = _zf_read_file(path, dir);
 }
 
 void zf_add_dir(zfolder *_dir, const char *path, bool recursive) {
-    DIR *d = opendir(path);
-    if (!d)
+#ifdef Z_DIRFD
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
         crashfmt("couldn't open directory -> %s", path);
 
+    _zf_dirwalk w;
+    memset(&w, 0, sizeof(_zf_dirwalk));
+    w.dir = _dir;
+    w.recursive = recursive;
+
+    size_t plen = strlen(path);
+    w.path = _zf_path_buf(NULL, &w.cap, plen);
+    memcpy(w.path, path, plen + 1);
+#ifdef Z_URING
+    static const uint8_t ops[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+    w.use_ring = _zf_uring_init(&w.ring, Z_URING_BATCH * 4, Z_URING_BATCH, ops, sizeof(ops));
+#endif
+    _zf_add_dir_at(&w, fd, plen);
+
+#ifdef Z_URING
+    if (w.use_ring)
+        _zf_uring_free(&w.ring);
+#endif
+    free(w.path);
+    close(fd);
+#else
+    _zf_dirents d;
+    _zf_dirents_open(&d, path);
+
     size_t plen = strlen(path); // path length
-    struct dirent *dir;
-    char temp_fname[Z_MAX_PATH_LEN];
-    while ((dir = readdir(d)) != NULL) {
-        if (dir->d_type == DT_DIR && recursive) {
-            // "." is the current directory, ".." is the previous directory
-            if (strcmp(dir->d_name, ".") == 0 || 
-                strcmp(dir->d_name, "..") == 0)
-                continue;
+    const char *name;
+    unsigned char type;
+    char *temp_fname = NULL;
+    size_t temp_cap = 0;
+    while ((name = _zf_dirents_next(&d, &type)) != NULL) {
+        if (type == DT_DIR && !recursive)
+            continue;
 
-            // get final path length (path/dir)
-            size_t dlen = strlen(dir->d_name) + plen + 1;
-            if (dlen > Z_MAX_PATH_LEN)
-                crashfmt("path is too long -> %s/%s", path, dir->d_name);
+        // get final path length (path/dir)
+        size_t dlen = strlen(name) + plen + 1;
+        temp_fname = _zf_path_buf(temp_fname, &temp_cap, dlen);
 
-            _concat_path(temp_fname, dir->d_name, path, plen);
+        _concat_path(temp_fname, name, path, plen);
+        if (type == DT_DIR)
             zf_add_dir(_dir, temp_fname, true);
-        }
-        else if (dir->d_type == DT_REG) {
-            // get final path length (path/dir)
-            size_t dlen = strlen(dir->d_name) + plen + 1;
-            if (dlen > Z_MAX_PATH_LEN)
-                crashfmt("path is too long -> %s/%s", path, dir->d_name);
-
-            _concat_path(temp_fname, dir->d_name, path, plen);
+        else
             zf_add_file(_dir, temp_fname);
+    }
+    free(temp_fname);
+    _zf_dirents_close(&d);
+#endif
+}
+
+void zf_add_dir_parallel(zfolder *dir, const char *path, bool recursive, int nthreads) {
+    if (nthreads == ZAUTO_THREADS)
+        nthreads = _zf_cpu_count();
+    if (nthreads < 1)
+        nthreads = 1;
+
+    _zf_walk walk;
+    memset(&walk, 0, sizeof(_zf_walk));
+    walk.nwalkers = nthreads;
+    walk.recursive = recursive;
+    walk.dir = dir;
+    _zf_mutex_init(&walk.lock);
+    _zf_cond_init(&walk.wake);
+    walk.walkers = (_zf_walker *) calloc(nthreads, sizeof(_zf_walker));
+    if (!walk.walkers)
+        crash("couldn't allocate walkers");
+    for (int i = 0; i < nthreads; ++i) {
+        walk.walkers[i].walk = &walk;
+        walk.walkers[i].id = i;
+        _zf_mutex_init(&walk.walkers[i].deque.lock);
+    }
+
+    size_t plen = strlen(path);
+    char *root = (char *) malloc(plen + 1);
+    if (!root)
+        crash("couldn't allocate path");
+    memcpy(root, path, plen + 1);
+    _zf_walk_push(&walk.walkers[0], root);
+
+    _zf_run_threads(nthreads, _zf_walk_worker, walk.walkers, sizeof(_zf_walker));
+
+    // sort by path, so the order doesn't depend on the scheduling
+    size_t nentries = 0;
+    for (int i = 0; i < nthreads; ++i)
+        nentries += walk.walkers[i].nentries;
+    _zf_entry *entries = (_zf_entry *) malloc((nentries ? nentries : 1) * sizeof(_zf_entry));
+    if (!entries)
+        crash("couldn't allocate entries");
+    nentries = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        _zf_walker *w = &walk.walkers[i];
+        if (w->nentries)
+            memcpy(entries + nentries, w->entries, w->nentries * sizeof(_zf_entry));
+        nentries += w->nentries;
+        free(w->entries);
+        free(w->deque.dirs);
+        _zf_mutex_free(&w->deque.lock);
+    }
+    qsort(entries, nentries, sizeof(_zf_entry), _zf_entry_cmp);
+
+    // reserve a slot for every file, so they can be read concurrently
+    if (nentries > UINT32_MAX)
+        crash("too many files");
+    _zf_reserve_files(dir, (uint32_t) nentries);
+
+    uint64_t total = 0;
+    walk.next = dir->nfiles;
+    for (size_t i = 0; i < nentries; ++i) {
+        zfile *file = _zf_new_file(dir, entries[i].path);
+        file->flen = entries[i].size;
+        file->mtime = entries[i].mtime;
+        file->ino = entries[i].ino;
+        if (dir->lazy) {
+            file->offset = 0;
+            file->source = ZFILE_DISK;
+            free(entries[i].path);
+            continue;
+        }
+#ifdef Z_MMAP
+        if (file->flen >= Z_MMAP_MIN_SIZE) {
+            int fd = open(entries[i].path, O_RDONLY);
+            bool mapped = fd >= 0 && _zf_map_fd(dir, file, fd);
+            if (fd >= 0)
+                close(fd);
+            if (mapped) {
+                free(entries[i].path);
+                continue;
+            }
         }
+#endif
+        file->offset = dir->dlen + total;
+        total += entries[i].size;
+        free(entries[i].path);
     }
-    closedir(d);
+    walk.end = dir->nfiles;
+    free(entries);
+    _zf_reserve(dir, total);
+    dir->dlen += total;
+
+    _zf_run_threads(nthreads, _zf_read_worker, walk.walkers, sizeof(_zf_walker));
+
+    _zf_cond_free(&walk.wake);
+    _zf_mutex_free(&walk.lock);
+    free(walk.walkers);
 }
 
 void zf_compress(zfolder *dir, const char *path, int compression_level) {
-    // maximum possible length (doesnt consider the length of every path
-    // it justs assumes the maximum possible length)
-    size_t max_len = 0;
-    max_len += sizeof(dir->nfiles);
-    max_len += dir->nfiles * sizeof(zfile);
-    max_len += sizeof(dir->dlen);
-    max_len += dir->dlen;
+    zoptions opt = zf_default_options(compression_level);
+    zf_compress_opt(dir, path, &opt);
+}
 
-    uint8_t *to_compress = (uint8_t*) malloc(max_len);
-    uint8_t *cur = to_compress;
+void zf_compress_opt(zfolder *dir, const char *path, const zoptions *opt) {
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        crashfmt("couldn't open file -> %s", path);
+    _zf_compress_to(dir, f, opt, NULL);
+    fclose(f);
+}
 
-    printf("number of files: %u\n", dir->nfiles);
+void zf_append(zfolder *dir, const char *path, const zoptions *opt) {
+    // nothing to append to, it's a new archive
+    z_stat_t st;
+    if (z_stat(path, &st) != 0) {
+        zf_compress_opt(dir, path, opt);
+        return;
+    }
 
-    copy_to_buf(cur, dir->nfiles);
-    for (uint32_t i = 0; i < dir->nfiles; ++i) {
-        copy_to_buf(cur, dir->files[i].plen);
-        copy_to_buf(cur, dir->files[i].flen);
-        ncopy_to_buf(cur, dir->files[i].path, dir->files[i].plen);
+    zfolder old;
+    zf_init(&old);
+    _zf_base base;
+    if (!_zf_base_open(&base, &old, path))
+        crashfmt("can't append to %s, it has no seek table", path);
+
+    // a file with the same path as a new one is replaced, its data stays
+    // in the archive but nothing points to it anymore
+    const char **names = (const char **) malloc((dir->nfiles ? dir->nfiles : 1) * sizeof(char *));
+    if (!names)
+        crash("couldn't allocate archive");
+    for (uint32_t i = 0; i < dir->nfiles; ++i)
+        names[i] = zf_get_path(dir, i);
+    qsort(names, dir->nfiles, sizeof(char *), _zf_path_cmp);
+    for (uint32_t i = 0; i < old.nfiles; ++i) {
+        const char *name = zf_get_path(&old, i);
+        base.keep[i] = !bsearch(&name, names, dir->nfiles, sizeof(char *), _zf_path_cmp);
+    }
+    free(names);
+
+    // the new frames go where the dictionary and the index were
+    _zf_archive *ar = (_zf_archive *) old.archive;
+    uint64_t data_end = ar->coffsets[ar->nframes];
+    _zf_archive_close(ar);
+    old.archive = NULL;
+
+    // the archive is written next to the old one with its frames copied
+    // as they are, and only replaces it once it is complete, if anything
+    // fails (a file can't be read) the old one is left as it was
+    char *tmp = _zf_temp_path(path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+        crashfmt("couldn't open file -> %s", tmp);
+    _zf_copy_range(path, 0, f, data_end);
+    _zf_compress_to(dir, f, opt, &base);
+    if (fclose(f) != 0)
+        crashfmt("couldn't write to file -> %s", tmp);
+    _zf_temp_replace(tmp, path);
+
+    _zf_base_free(&base);
+    zf_destroy(&old);
+}
+
+void zf_compress_incremental(zfolder *dir, const char *path, const char *previous, const zoptions *opt) {
+    // nothing to compare with, every file is compressed
+    z_stat_t st;
+    if (z_stat(previous, &st) != 0) {
+        zf_compress_opt(dir, path, opt);
+        return;
+    }
+
+    zfolder old;
+    zf_init(&old);
+    // nothing can be reused from an archive without a seek table
+    _zf_base base;
+    if (!_zf_base_open(&base, &old, previous)) {
+        zf_destroy(&old);
+        zf_compress_opt(dir, path, opt);
+        return;
     }
-    copy_to_buf(cur, dir->dlen);
-    ncopy_to_buf(cur, *dir->data, dir->dlen);
+    base.src = previous;
+    base.skip = (bool *) calloc(dir->nfiles ? dir->nfiles : 1, sizeof(bool));
+    if (!base.skip)
+        crash("couldn't allocate archive");
+    for (uint32_t i = 0; i < old.nfiles; ++i)
+        base.keep[i] = false;
 
-    size_t src_len = cur - (uint8_t *)to_compress;
-    size_t dst_len = ZSTD_compressBound(src_len);
-    uint8_t *dst = (uint8_t *) malloc(dst_len);
+    // a file is unchanged if it has the same size, modification time
+    // and inode, files without a modification time never are
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        uint32_t found;
+        if (!zf_find_file(&old, zf_get_path(dir, i), &found) || base.keep[found])
+            continue;
+        zfile *file = &dir->files[i];
+        zfile *prev = &old.files[found];
+        if (file->mtime == 0 || file->flen != prev->flen ||
+            file->mtime != prev->mtime || file->ino != prev->ino)
+            continue;
+        base.keep[found] = true;
+        base.skip[i] = true;
+    }
+    _zf_base_drop_sparse(&base, dir);
 
-    size_t res = ZSTD_compress(dst, dst_len, to_compress, src_len, compression_level);
-    if (ZSTD_isError(res))
-        crash("couldn't compress data");
+    // the frames are copied from previous while the new archive is written,
+    // so if it replaces previous it goes next to it and takes its place at the end
+    char *out = strcmp(path, previous) == 0 ? _zf_temp_path(path) : NULL;
 
-    _write_whole_file(path, dst, res);
+    FILE *f = fopen(out ? out : path, "wb");
+    if (!f)
+        crashfmt("couldn't open file -> %s", out ? out : path);
+    _zf_compress_to(dir, f, opt, &base);
+    fclose(f);
 
-    free(to_compress);
-    free(dst);
+    _zf_base_free(&base);
+    zf_destroy(&old);
 
-    size_t srckb = src_len / 1024;
-    size_t dstkb = res / 1024;
+    if (out)
+        _zf_temp_replace(out, path);
+}
 
-    printf("original size:   %zu b -- %zu kb\n", src_len, srckb);
-    printf("compressed size: %zu b -- %zu kb\n", res, dstkb);
+zoptions zf_default_options(int compression_level) {
+    zoptions opt;
+    memset(&opt, 0, sizeof(zoptions));
+    opt.level = compression_level;
+    opt.nthreads = ZAUTO_THREADS;
+    opt.block_size = Z_BLOCK_SIZE;
+    opt.dedup = true;
+    return opt;
 }
 
 void zf_decompress(zfolder *dir, const char *fname) {
-    uint8_t *compressed;
-    // compressed length
-    uint32_t clen = _read_whole_file(fname, &compressed);
+    zf_open(dir, fname);
+    _zf_archive *ar = (_zf_archive *) dir->archive;
+    // an archive without a seek table is already decompressed
+    if (!ar)
+        return;
 
-    size_t res = ZSTD_getFrameContentSize(compressed, clen);
+    // dlen was set by zf_open, reserve the space from an empty buffer
+    uint64_t dlen = dir->dlen;
+    dir->dlen = 0;
+    _zf_reserve(dir, dlen);
+    dir->dlen = dlen;
 
-    if (res == ZSTD_CONTENTSIZE_UNKNOWN || res == ZSTD_CONTENTSIZE_ERROR)
-        crash("couldn't retrieve size from file");
+    // every frame is decompressed straight to its place in the data, with
+    // a single call if it is small enough to be read in memory at once
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (!dctx)
+        crash("couldn't create decompression context");
+    for (uint32_t i = 0; i < ar->nframes; ++i) {
+        // zf_open checked that the frames add up to dlen
+        if (ar->frames[i].dsize > dlen - ar->doffsets[i])
+            crash("frame is outside of the data");
+        uint8_t *dst = dir->data + ar->doffsets[i];
+        if (ar->frames[i].csize <= Z_IO_CHUNK) {
+            _zf_archive_load(ar, i, dst, dctx, NULL);
+            continue;
+        }
 
-    size_t dst_len = res;
-    uint8_t *dst = (uint8_t *) malloc(dst_len);
-    res = ZSTD_decompress(dst, dst_len, compressed, clen);
-    free(compressed);
-    if (ZSTD_isError(res))
-        crash("couldn't decompress data");
+        z_fseek(ar->f, (z_off_t) ar->coffsets[i], SEEK_SET);
+        _zf_dstream stream;
+        _zf_dstream_init(&stream, ar->f);
+        _zf_archive_dctx(ar, stream.dctx);
+        _zf_dstream_read(&stream, dst, (size_t) ar->frames[i].dsize);
+        _zf_dstream_free(&stream);
+    }
+    ZSTD_freeDCtx(dctx);
+
+    _zf_archive_close(ar);
+    dir->archive = NULL;
+}
 
-    uint8_t *buf = dst;
+void zf_open(zfolder *dir, const char *fname) {
+    _zf_archive *ar = (_zf_archive *) calloc(1, sizeof(_zf_archive));
+    if (!ar)
+        crash("couldn't allocate archive");
 
-    read_from_buf(buf, dir->nfiles);
-    for (uint32_t i = 0; i < dir->nfiles; ++i) {
-        read_from_buf(buf, dir->files[i].plen);
-        read_from_buf(buf, dir->files[i].flen);
-        nread_from_buf(buf, dir->files[i].path, dir->files[i].plen);
+    ar->f = fopen(fname, "rb");
+    if (!ar->f)
+        crashfmt("couldn't open file -> %s", fname);
+
+    _zf_frame *frames;
+    uint8_t version;
+    uint32_t nframes = _zf_read_seek_table(ar->f, &frames, &version);
+    if (nframes == 0) {
+        // there is no index to read on its own, everything is decompressed
+        free(frames);
+        zf_clear(dir);
+        _zf_read_legacy(dir, ar->f);
+        fclose(ar->f);
+        free(ar);
+        _zf_index_paths(dir);
+        return;
     }
-    read_from_buf(buf, dir->dlen);
-    dir->data = (uint8_t *) malloc(dir->dlen);
-    nread_from_buf(buf, *dir->data, dir->dlen);
 
-    free(dst);
+    ar->frames = frames;
+    ar->nframes = nframes - 1;
+    ar->coffsets = (uint64_t *) malloc(nframes * sizeof(uint64_t));
+    ar->doffsets = (uint64_t *) malloc(nframes * sizeof(uint64_t));
+    ar->blocks = (uint8_t **) calloc(nframes, sizeof(uint8_t *));
+    if (!ar->coffsets || !ar->doffsets || !ar->blocks)
+        crash("couldn't allocate seek table");
+
+    uint64_t coffset = 0;
+    uint64_t doffset = 0;
+    for (uint32_t i = 0; i < nframes; ++i) {
+        ar->coffsets[i] = coffset;
+        ar->doffsets[i] = doffset;
+        coffset += frames[i].csize;
+        doffset += frames[i].dsize;
+    }
+
+    // the last frame is the index, the dictionary comes before it
+    zf_clear(dir);
+    dir->archive = ar;
+    if (_zf_read_index(ar, &frames[ar->nframes], dir, version)) {
+        if (ar->nframes == 0)
+            crash("dictionary frame is missing");
+        ar->nframes--;
+        _zf_archive_load_dict(ar);
+    }
+    _zf_archive_check(ar, dir);
+    _zf_index_paths(dir);
 }
 
 void zf_decompress_todir(zfolder *dir, const char *output, bool overwrite) {
@@ -308,139 +1532,3280 @@ void zf_decompress_todir(zfolder *dir, const char *output, bool overwrite) {
     _create_dir(output);
 
     size_t pathlen = strlen(output);
+    _zf_create_dirs(dir, output, pathlen);
 
-    char temp_path[Z_MAX_PATH_LEN * 2];
-    for (uint32_t i = 0; i < dir->nfiles; ++i) {
-        uint8_t *data = zf_get_file(dir, i);
-        size_t len = dir->files[i].flen;
-
-        // make sure that the path finishes with \0
-        dir->files[i].path[dir->files[i].plen] = '\0';
+#ifdef Z_URING
+    if (_zf_uring_write_files(dir, output, pathlen))
+        return;
+#endif
 
+    char *temp_path = NULL;
+    size_t temp_cap = 0;
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
         size_t path_len = dir->files[i].plen + pathlen + 1;
-        memset(temp_path, '\0', path_len);
-        _concat_path(temp_path, dir->files[i].path, output, pathlen);
+        temp_path = _zf_path_buf(temp_path, &temp_cap, path_len);
+        _concat_path(temp_path, zf_get_path(dir, i), output, pathlen);
 
-        _create_necessary_dirs(temp_path);
-
-        _write_whole_file(temp_path, data, len);
+        _zf_write_file(dir, i, temp_path);
     }
+    free(temp_path);
 }
 
-uint8_t *zf_get_file(zfolder *dir, uint32_t index) {
-    uint32_t offset = 0;
-    for (uint32_t i = 0; i < index; ++i)
-        offset += dir->files[i].flen;
+void zf_decompress_todir_parallel(zfolder *dir, const char *output, bool overwrite, int nthreads) {
+    struct stat st = { 0 };
+    if (stat(output, &st) != -1 && !overwrite)
+        crashfmt("folder %s already exists", output);
+    _create_dir(output);
 
-    return dir->data + offset;
-}
+    if (nthreads == ZAUTO_THREADS)
+        nthreads = _zf_cpu_count();
+    if (nthreads < 1)
+        nthreads = 1;
 
+    _zf_extract ex;
+    memset(&ex, 0, sizeof(_zf_extract));
+    ex.dir = dir;
+    ex.output = output;
+    ex.outlen = strlen(output);
+    ex.njobs = dir->nfiles;
+    _zf_mutex_init(&ex.lock);
 
-void zf_destroy(zfolder *dir) {
-    free(dir->data);
-}
+    _zf_extractor *workers = (_zf_extractor *) calloc(nthreads, sizeof(_zf_extractor));
+    if (!workers)
+        crash("couldn't allocate workers");
+    for (int i = 0; i < nthreads; ++i)
+        workers[i].ex = &ex;
 
-// == IMPLEMENTATION ============================================
+    // the directories are created before any thread starts
+    _zf_create_dirs(dir, output, ex.outlen);
 
-static uint32_t _zf_read_file(const char *path, zfolder *dir) {
-    FILE *f = fopen(path, "rb");
-    if (!f)
-        crashfmt("couldn't open file -> %s", path);
-    // get file length
-    fseek(f, 0, SEEK_END);
-    long len = ftell(f);
-    if (len < 0)
-        crash("length of file is negative");
-    fseek(f, 0, SEEK_SET);
+    // with an archive open every job is a frame, so that it
+    // is decompressed only once and by a single thread
+    _zf_archive *ar = (_zf_archive *) dir->archive;
+    if (ar) {
+        ex.njobs = ar->nframes;
+        ex.order = (uint32_t *) malloc((dir->nfiles ? dir->nfiles : 1) * sizeof(uint32_t));
+        ex.first = (uint32_t *) calloc(ar->nframes + 1, sizeof(uint32_t));
+        uint32_t *frames = (uint32_t *) malloc((dir->nfiles ? dir->nfiles : 1) * sizeof(uint32_t));
+        if (!ex.order || !ex.first || !frames)
+            crash("couldn't allocate extraction jobs");
 
-    // allocate enough space to read the new data
-    dir->data = (uint8_t *) realloc(dir->data, dir->dlen + len);
-    if (!dir->data)
-        crashfmt("couldn't allocate data when reading the file %s", path);
-    // read data at the end of the buffer
-    fread((dir->data + dir->dlen), len, 1, f);
-    dir->dlen += len;
+        // the files that aren't in the data are written at the end
+        for (uint32_t i = 0; i < dir->nfiles; ++i) {
+            if (dir->files[i].source != ZFILE_DATA)
+                continue;
+            frames[i] = _zf_archive_find_frame(ar, dir->files[i].offset);
+            ex.first[frames[i] + 1]++;
+        }
+        for (uint32_t i = 0; i < ar->nframes; ++i)
+            ex.first[i + 1] += ex.first[i];
+        for (uint32_t i = 0; i < dir->nfiles; ++i) {
+            if (dir->files[i].source == ZFILE_DATA)
+                ex.order[ex.first[frames[i]]++] = i;
+        }
+        // the previous loop moved every first to the end of its frame
+        memmove(ex.first + 1, ex.first, ar->nframes * sizeof(uint32_t));
+        ex.first[0] = 0;
+        free(frames);
+    }
 
-    fclose(f);
-    return len;
-}
+    // zf_get_file isn't thread safe for files that are only on disk
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        if (dir->files[i].source == ZFILE_DISK)
+            _zf_load_file(dir, i);
+    }
 
-static uint32_t _read_whole_file(const char *fname, uint8_t **data) {
-    FILE *f = fopen(fname, "rb");
-    if (!f)
-        crashfmt("couldn't open file -> %s", fname);
-    // get file length
-    fseek(f, 0, SEEK_END);
-    long len = ftell(f);
-    if (len < 0)
-        crash("length of file is negative");
-    fseek(f, 0, SEEK_SET);
+    _zf_run_threads(nthreads, _zf_extract_worker, workers, sizeof(_zf_extractor));
 
-    // allocate enough space to read the new data
-    *data = (uint8_t *) malloc(len);
+    // chunked files need blocks of the archive, which isn't
+    // thread safe, so they are written by this thread
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        zfile *file = &dir->files[i];
+        if (file->source == ZFILE_CHUNKED || (ar && file->source != ZFILE_DATA)) {
+            workers[0].path = _zf_path_buf(workers[0].path, &workers[0].cap, file->plen + ex.outlen + 1);
+            _concat_path(workers[0].path, zf_get_path(dir, i), output, ex.outlen);
+            _zf_write_file(dir, i, workers[0].path);
+        }
+    }
+
+    for (int i = 0; i < nthreads; ++i) {
+        ZSTD_freeDCtx(workers[i].dctx);
+        free(workers[i].path);
+    }
+    free(workers);
+    free(ex.order);
+    free(ex.first);
+    _zf_mutex_free(&ex.lock);
+}
+
+void zf_extract_stream(const char *fname, const char *output, bool overwrite) {
+    struct stat st = { 0 };
+    if (stat(output, &st) != -1 && !overwrite)
+        crashfmt("folder %s already exists", output);
+    _create_dir(output);
+
+    // only the index is kept in memory, the data is written
+    // to the output files as it gets decompressed
+    zfolder dir;
+    zf_init(&dir);
+    zf_open(&dir, fname);
+    _zf_archive *ar = (_zf_archive *) dir.archive;
+    // an archive without a seek table is already decompressed
+    if (!ar) {
+        zf_decompress_todir(&dir, output, true);
+        zf_destroy(&dir);
+        return;
+    }
+
+    z_fseek(ar->f, 0, SEEK_SET);
+    _zf_dstream stream;
+    _zf_dstream_init(&stream, ar->f);
+    _zf_archive_dctx(ar, stream.dctx);
+
+    size_t pathlen = strlen(output);
+    _zf_create_dirs(&dir, output, pathlen);
+
+    // the data has every content once, in the order it is first needed by
+    // the files, the rest is copied back from the files already written
+    _zf_stream_extract sx;
+    memset(&sx, 0, sizeof(_zf_stream_extract));
+    sx.dir = &dir;
+    sx.stream = &stream;
+    sx.output = output;
+    sx.outlen = pathlen;
+    sx.fname = fname;
+
+    char *temp_path = NULL;
+    size_t temp_cap = 0;
+    _zf_chunk *chunks = (_zf_chunk *) dir.chunks;
+    for (uint32_t i = 0; i < dir.nfiles; ++i) {
+        zfile *file = &dir.files[i];
+        size_t path_len = file->plen + pathlen + 1;
+        temp_path = _zf_path_buf(temp_path, &temp_cap, path_len);
+        _concat_path(temp_path, zf_get_path(&dir, i), output, pathlen);
+
+        FILE *out = fopen(temp_path, "wb");
+        if (!out)
+            crashfmt("couldn't open file -> %s", temp_path);
+        if (file->source == ZFILE_CHUNKED) {
+            _zf_chunk *chunk = chunks + file->offset;
+            for (uint64_t done = 0; done < file->flen; done += chunk->len, chunk++)
+                _zf_stream_piece(&sx, out, i, done, chunk->offset, chunk->len);
+        }
+        else if (file->flen > 0) {
+            _zf_stream_piece(&sx, out, i, 0, file->offset, file->flen);
+        }
+        fclose(out);
+    }
+
+    free(temp_path);
+    free(sx.path);
+    free(sx.extents);
+    if (sx.back_f) {
+        _zf_dstream_free(&sx.back);
+        fclose(sx.back_f);
+    }
+    _zf_dstream_free(&stream);
+    zf_destroy(&dir);
+}
+
+uint8_t *zf_extract_file(const char *fname, const char *path, uint64_t *len) {
+    zfolder dir;
+    zf_init(&dir);
+    zf_open(&dir, fname);
+    _zf_archive *ar = (_zf_archive *) dir.archive;
+
+    uint8_t *data = NULL;
+    uint32_t index;
+    if (zf_find_file(&dir, path, &index)) {
+        uint64_t flen = dir.files[index].flen;
+        if (flen > SIZE_MAX)
+            crashfmt("%s doesn't fit in memory", path);
+        data = (uint8_t *) malloc(flen ? (size_t) flen : 1);
+        if (!data)
+            crashfmt("couldn't allocate data for %s", path);
+
+        if (!ar) {
+            // an archive without a seek table is already decompressed
+            if (flen > 0)
+                memcpy(data, zf_get_file(&dir, index), (size_t) flen);
+        }
+        else if (dir.files[index].source == ZFILE_CHUNKED) {
+            // the chunks can be in many blocks, the blocks are decompressed whole
+            _zf_chunk *chunk = (_zf_chunk *) dir.chunks + dir.files[index].offset;
+            for (uint64_t done = 0; done < flen; done += chunk->len, chunk++)
+                memcpy(data + done, _zf_data_at(&dir, chunk->offset), (size_t) chunk->len);
+        }
+        else if (flen > 0) {
+            // decompress the frame only up to the end of the file
+            uint64_t offset = dir.files[index].offset;
+            uint32_t frame = _zf_archive_find_frame(ar, offset);
+
+            z_fseek(ar->f, (z_off_t) ar->coffsets[frame], SEEK_SET);
+            _zf_dstream stream;
+            _zf_dstream_init(&stream, ar->f);
+            _zf_archive_dctx(ar, stream.dctx);
+            _zf_dstream_skip(&stream, offset - ar->doffsets[frame]);
+            _zf_dstream_read(&stream, data, (size_t) flen);
+            _zf_dstream_free(&stream);
+        }
+        *len = flen;
+    }
+
+    zf_destroy(&dir);
+    return data;
+}
+
+uint8_t *zf_get_file(zfolder *dir, uint32_t index) {
+    if (dir->files[index].source == ZFILE_DISK)
+        _zf_load_file(dir, index);
+    else if (dir->files[index].source == ZFILE_CHUNKED)
+        _zf_load_chunks(dir, index);
+
+    uint64_t offset = dir->files[index].offset;
+    if (dir->files[index].source == ZFILE_MAPPED)
+        return (uint8_t *) ((_zf_map *) dir->maps)[offset].ptr;
+
+    return _zf_data_at(dir, offset);
+}
+
+const char *zf_get_path(zfolder *dir, uint32_t index) {
+    return dir->paths + dir->files[index].path;
+}
+
+bool zf_find_file(zfolder *dir, const char *path, uint32_t *index) {
+    // the files of an archive are in the lookup table,
+    // the ones added after zf_open are searched one by one
+    size_t len = strlen(path);
+    if (dir->nlookup > 0) {
+        uint32_t *slot = _zf_path_slot(dir, path, len);
+        if (*slot != UINT32_MAX) {
+            *index = *slot;
+            return true;
+        }
+    }
+    for (uint32_t i = dir->nlookup; i < dir->nfiles; ++i) {
+        if (dir->files[i].plen == len && memcmp(zf_get_path(dir, i), path, len) == 0) {
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void zf_clear(zfolder *dir) {
+    if (dir->archive)
+        _zf_archive_close((_zf_archive *) dir->archive);
+    dir->archive = NULL;
+    for (uint32_t i = 0; i < dir->nmaps; ++i) {
+        _zf_map *map = &((_zf_map *) dir->maps)[i];
+#ifdef Z_MMAP
+        if (map->mapped) {
+            munmap(map->ptr, (size_t) map->len);
+            continue;
+        }
+#endif
+        free(map->ptr);
+    }
+    dir->nmaps = 0;
+    dir->nchunks = 0;
+    dir->nlookup = 0;
+    dir->nfiles = 0;
+    dir->pathlen = 0;
+    dir->dlen = 0;
+}
+
+void zf_destroy(zfolder *dir) {
+    zf_clear(dir);
+    free(dir->data);
+    free(dir->files);
+    free(dir->paths);
+    free(dir->maps);
+    free(dir->chunks);
+    free(dir->lookup);
+    dir->data = NULL;
+    dir->dcap = 0;
+    dir->files = NULL;
+    dir->fcap = 0;
+    dir->paths = NULL;
+    dir->pathcap = 0;
+    dir->maps = NULL;
+    dir->mapcap = 0;
+    dir->chunks = NULL;
+    dir->ccap = 0;
+    dir->lookup = NULL;
+    dir->lookcap = 0;
+}
+
+// == IMPLEMENTATION ============================================
+
+static void _zf_cstream_init(_zf_cstream *s, FILE *f, const zoptions *opt) {
+    memset(s, 0, sizeof(_zf_cstream));
+    s->f = f;
+    s->cctx = ZSTD_createCCtx();
+    if (!s->cctx)
+        crash("couldn't create compression context");
+    _zf_cctx_params(s->cctx, opt);
+
+    int nthreads = opt->nthreads == ZAUTO_THREADS ? _zf_cpu_count() : opt->nthreads;
+    // if zstd was built without multithreading support this fails
+    // and compression just happens on the calling thread
+    if (nthreads > 0 && !ZSTD_isError(ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_nbWorkers, nthreads))) {
+        if (opt->job_size) {
+            // zstd takes an int, bigger sizes are clamped to the biggest job
+            ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_jobSize);
+            size_t job_size = opt->job_size;
+            if (!ZSTD_isError(bounds.error) && job_size > (size_t) bounds.upperBound)
+                job_size = (size_t) bounds.upperBound;
+            ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_jobSize, (int) job_size);
+        }
+        if (opt->overlap_log)
+            ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_overlapLog, opt->overlap_log);
+    }
+
+    s->in_cap = ZSTD_CStreamInSize();
+    s->out_cap = ZSTD_CStreamOutSize();
+    s->in = (uint8_t *) malloc(s->in_cap);
+    s->out = (uint8_t *) malloc(s->out_cap);
+    if (!s->in || !s->out)
+        crash("couldn't allocate compression buffers");
+}
+
+static void _zf_cstream_begin(_zf_cstream *s, uint64_t src_len) {
+    // the exact length is stored in the frame header
+    ZSTD_CCtx_setPledgedSrcSize(s->cctx, src_len);
+    s->start = s->written;
+}
+
+static void _zf_cstream_write(_zf_cstream *s, const void *data, size_t len) {
+    const uint8_t *src = (const uint8_t *) data;
+    while (len > 0) {
+        // big writes skip the staging buffer entirely
+        if (s->in_len == 0 && len >= s->in_cap) {
+            _zf_cstream_feed(s, src, len, ZSTD_e_continue);
+            return;
+        }
+
+        size_t n = s->in_cap - s->in_len;
+        if (n > len)
+            n = len;
+        memcpy(s->in + s->in_len, src, n);
+        s->in_len += n;
+        src += n;
+        len -= n;
+
+        if (s->in_len == s->in_cap) {
+            _zf_cstream_feed(s, s->in, s->in_len, ZSTD_e_continue);
+            s->in_len = 0;
+        }
+    }
+}
+
+static void _zf_cstream_varint(_zf_cstream *s, uint64_t value) {
+    uint8_t buf[Z_MAX_VARINT_SIZE];
+    _zf_cstream_write(s, buf, _zf_put_varint(buf, value));
+}
+
+static uint64_t _zf_cstream_end(_zf_cstream *s) {
+    _zf_cstream_feed(s, s->in, s->in_len, ZSTD_e_end);
+    s->in_len = 0;
+    return s->written - s->start;
+}
+
+static void _zf_cstream_free(_zf_cstream *s) {
+    ZSTD_freeCCtx(s->cctx);
+    free(s->in);
+    free(s->out);
+}
+
+static void _zf_cstream_copy(_zf_cstream *s, FILE *src, uint64_t len, const char *path) {
+    while (len > 0) {
+        size_t n = s->in_cap - s->in_len;
+        if (n > len)
+            n = (size_t) len;
+        // the size is already in the frame header, it can't change now
+        if (fread(s->in + s->in_len, 1, n, src) != n)
+            crashfmt("file changed while it was being compressed -> %s", path);
+        s->in_len += n;
+        len -= n;
+
+        if (s->in_len == s->in_cap) {
+            _zf_cstream_feed(s, s->in, s->in_len, ZSTD_e_continue);
+            s->in_len = 0;
+        }
+    }
+}
+
+static void _zf_cstream_feed(_zf_cstream *s, const void *data, size_t len, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer input = { data, len, 0 };
+    bool finished = false;
+    while (!finished) {
+        ZSTD_outBuffer output = { s->out, s->out_cap, 0 };
+        size_t remaining = ZSTD_compressStream2(s->cctx, &output, &input, mode);
+        if (ZSTD_isError(remaining))
+            crashfmt("couldn't compress data: %s", ZSTD_getErrorName(remaining));
+
+        _zf_fwrite(s->f, s->out, output.pos);
+        s->written += output.pos;
+
+        // when ending the frame, zstd has to flush everything it buffered
+        finished = mode == ZSTD_e_end ? remaining == 0 : input.pos == input.size;
+    }
+}
+
+static void _zf_dstream_init(_zf_dstream *s, FILE *f) {
+    memset(s, 0, sizeof(_zf_dstream));
+    s->f = f;
+    s->dctx = ZSTD_createDCtx();
+    if (!s->dctx)
+        crash("couldn't create decompression context");
+
+    s->in_cap = ZSTD_DStreamInSize();
+    s->out_cap = ZSTD_DStreamOutSize();
+    s->in = (uint8_t *) malloc(s->in_cap);
+    s->out = (uint8_t *) malloc(s->out_cap);
+    if (!s->in || !s->out)
+        crash("couldn't allocate decompression buffers");
+    s->input.src = s->in;
+}
+
+static void _zf_dstream_read(_zf_dstream *s, void *data, size_t len) {
+    uint8_t *dst = (uint8_t *) data;
+    while (len > 0) {
+        // big reads are decompressed straight into dst
+        if (s->out_pos == s->out_len && len >= s->out_cap) {
+            ZSTD_outBuffer output = { dst, len, 0 };
+            while (output.pos < output.size) {
+                if (s->input.pos == s->input.size) {
+                    s->input.size = fread(s->in, 1, s->in_cap, s->f);
+                    s->input.pos = 0;
+                    if (s->input.size == 0)
+                        crash("unexpected end of compressed data");
+                }
+                size_t res = ZSTD_decompressStream(s->dctx, &output, &s->input);
+                if (ZSTD_isError(res))
+                    crashfmt("couldn't decompress data: %s", ZSTD_getErrorName(res));
+            }
+            return;
+        }
+
+        if (s->out_pos == s->out_len && !_zf_dstream_fill(s))
+            crash("unexpected end of compressed data");
+
+        size_t n = s->out_len - s->out_pos;
+        if (n > len)
+            n = len;
+        memcpy(dst, s->out + s->out_pos, n);
+        s->out_pos += n;
+        dst += n;
+        len -= n;
+    }
+}
+
+static void _zf_dstream_copy(_zf_dstream *s, FILE *dst, uint64_t len) {
+    while (len > 0) {
+        if (s->out_pos == s->out_len && !_zf_dstream_fill(s))
+            crash("unexpected end of compressed data");
+
+        size_t n = s->out_len - s->out_pos;
+        if (n > len)
+            n = (size_t) len;
+        _zf_fwrite(dst, s->out + s->out_pos, n);
+        s->out_pos += n;
+        len -= n;
+    }
+}
+
+static void _zf_dstream_skip(_zf_dstream *s, uint64_t len) {
+    while (len > 0) {
+        if (s->out_pos == s->out_len && !_zf_dstream_fill(s))
+            crash("unexpected end of compressed data");
+
+        size_t n = s->out_len - s->out_pos;
+        if (n > len)
+            n = (size_t) len;
+        s->out_pos += n;
+        len -= n;
+    }
+}
+
+static void _zf_dstream_free(_zf_dstream *s) {
+    ZSTD_freeDCtx(s->dctx);
+    free(s->in);
+    free(s->out);
+}
+
+static bool _zf_dstream_fill(_zf_dstream *s) {
+    s->out_pos = 0;
+    s->out_len = 0;
+    while (s->out_len == 0) {
+        if (s->input.pos == s->input.size) {
+            s->input.size = fread(s->in, 1, s->in_cap, s->f);
+            s->input.pos = 0;
+            if (s->input.size == 0)
+                return false;
+        }
+
+        ZSTD_outBuffer output = { s->out, s->out_cap, 0 };
+        size_t res = ZSTD_decompressStream(s->dctx, &output, &s->input);
+        if (ZSTD_isError(res))
+            crashfmt("couldn't decompress data: %s", ZSTD_getErrorName(res));
+        s->out_len = output.pos;
+    }
+    return true;
+}
+
+static void _zf_write_seek_table(FILE *f, _zf_frame *frames, uint32_t nframes) {
+    uint8_t *table = (uint8_t *) malloc((size_t) nframes * 2 * Z_MAX_VARINT_SIZE + Z_SEEK_FOOTER_SIZE);
+    if (!table)
+        crash("couldn't allocate seek table");
+
+    uint8_t *buf = table;
+    for (uint32_t i = 0; i < nframes; ++i) {
+        buf += _zf_put_varint(buf, frames[i].csize);
+        buf += _zf_put_varint(buf, frames[i].dsize);
+    }
+    uint32_t table_len = (uint32_t) (buf - table);
+    uint8_t version = Z_FORMAT_VERSION;
+    uint32_t format_magic = Z_FORMAT_MAGIC;
+    copy_to_buf(buf, table_len);
+    copy_to_buf(buf, nframes);
+    copy_to_buf(buf, version);
+    copy_to_buf(buf, format_magic);
+
+    uint32_t magic = Z_SKIPPABLE_MAGIC;
+    uint32_t size = (uint32_t) (buf - table);
+    _zf_fwrite(f, &magic, sizeof(magic));
+    _zf_fwrite(f, &size, sizeof(size));
+    _zf_fwrite(f, table, size);
+
+    free(table);
+}
+
+static uint32_t _zf_read_seek_table(FILE *f, _zf_frame **frames, uint8_t *version_out) {
+    uint8_t footer[Z_SEEK_FOOTER_SIZE];
+    uint8_t *buf = footer;
+    uint32_t table_len, nframes, magic;
+    uint8_t version;
+
+    *frames = NULL;
+    if (z_fseek(f, -Z_SEEK_FOOTER_SIZE, SEEK_END) != 0 ||
+        fread(footer, sizeof(footer), 1, f) != 1)
+        return 0;
+    read_from_buf(buf, table_len);
+    read_from_buf(buf, nframes);
+    read_from_buf(buf, version);
+    read_from_buf(buf, magic);
+    if (magic != Z_FORMAT_MAGIC)
+        return 0;
+    if (version < 1 || version > Z_FORMAT_VERSION)
+        crashfmt("unsupported format version: %u", version);
+    // every entry takes at least two bytes
+    if (table_len < (uint64_t) nframes * 2)
+        crash("seek table is corrupted");
+
+    if (z_fseek(f, -(z_off_t) (Z_SEEK_FOOTER_SIZE + (z_off_t) table_len), SEEK_END) != 0)
+        crash("seek table is bigger than the file");
+
+    uint8_t *table = (uint8_t *) malloc(table_len);
+    *frames = (_zf_frame *) malloc(nframes * sizeof(_zf_frame));
+    if (!table || (nframes && !*frames))
+        crash("couldn't allocate seek table");
+    _zf_fread(f, table, table_len);
+
+    buf = table;
+    for (uint32_t i = 0; i < nframes; ++i) {
+        (*frames)[i].csize = _zf_get_varint(&buf, table + table_len);
+        (*frames)[i].dsize = _zf_get_varint(&buf, table + table_len);
+    }
+
+    free(table);
+    *version_out = version;
+    return nframes;
+}
+
+static bool _zf_read_index(_zf_archive *ar, _zf_frame *index, zfolder *dir, uint8_t version) {
+    if (index->csize > SIZE_MAX || index->dsize > SIZE_MAX)
+        crash("index doesn't fit in memory");
+    uint8_t *compressed = (uint8_t *) malloc((size_t) index->csize);
+    uint8_t *decompressed = (uint8_t *) malloc((size_t) index->dsize);
+    if (!compressed || !decompressed)
+        crash("couldn't allocate index");
+
+    z_fseek(ar->f, (z_off_t) ar->coffsets[ar->nframes], SEEK_SET);
+    _zf_fread(ar->f, compressed, index->csize);
+    size_t res = ZSTD_decompress(decompressed, (size_t) index->dsize, compressed, (size_t) index->csize);
+    if (ZSTD_isError(res) || res != index->dsize)
+        crash("couldn't decompress index");
+    free(compressed);
+
+    uint8_t *buf = decompressed;
+    uint8_t *end = decompressed + index->dsize;
+    uint64_t nfiles = _zf_get_varint(&buf, end);
+    // plen + flen + offset take at least a byte each
+    if (nfiles > UINT32_MAX || nfiles * 3 > index->dsize)
+        crashfmt("index is too small for %llu files", (unsigned long long) nfiles);
+    _zf_reserve_files(dir, (uint32_t) nfiles);
+    // the paths can't take more space than the index itself
+    _zf_reserve_paths(dir, (size_t) index->dsize + nfiles);
+    dir->nfiles = (uint32_t) nfiles;
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        zfile *file = &dir->files[i];
+        uint64_t plen = _zf_get_varint(&buf, end);
+        file->flen = _zf_get_varint(&buf, end);
+        file->offset = _zf_get_varint(&buf, end);
+        file->source = ZFILE_DATA;
+        if (plen > UINT16_MAX || (uint64_t) (end - buf) < plen)
+            crash("index is truncated");
+        file->plen = (uint16_t) plen;
+        file->path = _zf_push_path(dir, (const char *) buf, file->plen);
+        buf += file->plen;
+        if (version >= 4 && _zf_get_varint(&buf, end) != 0)
+            file->source = ZFILE_CHUNKED;
+        file->mtime = version >= 5 ? _zf_get_varint(&buf, end) : 0;
+        file->ino = version >= 5 ? _zf_get_varint(&buf, end) : 0;
+    }
+    dir->dlen = _zf_get_varint(&buf, end);
+    bool dict = version >= 2 && _zf_get_varint(&buf, end) != 0;
+
+    uint64_t nchunks = version >= 4 ? _zf_get_varint(&buf, end) : 0;
+    // offset + len take at least a byte each
+    if (nchunks > UINT32_MAX || nchunks * 2 > (uint64_t) (end - buf))
+        crash("index is truncated");
+    if (nchunks > dir->ccap)
+        dir->chunks = _zf_grow(dir->chunks, &dir->ccap, (size_t) nchunks, 256, sizeof(_zf_chunk));
+    dir->nchunks = (uint32_t) nchunks;
+    _zf_chunk *chunks = (_zf_chunk *) dir->chunks;
+    for (uint32_t i = 0; i < dir->nchunks; ++i) {
+        chunks[i].offset = _zf_get_varint(&buf, end);
+        chunks[i].len = _zf_get_varint(&buf, end);
+        if (chunks[i].offset > dir->dlen || chunks[i].len > dir->dlen - chunks[i].offset)
+            crashfmt("chunk %u is outside of the data", i);
+    }
+
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        zfile *file = &dir->files[i];
+        if (file->source != ZFILE_CHUNKED) {
+            if (file->offset > dir->dlen || file->flen > dir->dlen - file->offset)
+                crashfmt("file %s is outside of the data", zf_get_path(dir, i));
+            continue;
+        }
+        // the chunks have to add up to the length of the file
+        uint64_t len = 0;
+        for (uint64_t k = file->offset; len < file->flen; ++k) {
+            if (k >= dir->nchunks || chunks[k].len == 0)
+                crashfmt("chunks of %s are outside of the chunk table", zf_get_path(dir, i));
+            len += chunks[k].len;
+        }
+        if (len != file->flen)
+            crashfmt("chunks of %s don't match its length", zf_get_path(dir, i));
+    }
+
+    uint64_t window_log = version >= 6 ? _zf_get_varint(&buf, end) : 0;
+    if (window_log > 64)
+        crash("index is corrupted");
+    ar->window_log = (int) window_log;
+
+    free(decompressed);
+    return dict;
+}
+
+static void _zf_archive_load_dict(_zf_archive *ar) {
+    // ar->nframes is the index of the dictionary frame
+    _zf_frame *fr = &ar->frames[ar->nframes];
+    if (fr->dsize > SIZE_MAX)
+        crash("dictionary doesn't fit in memory");
+    uint8_t *dict = (uint8_t *) malloc(fr->dsize ? (size_t) fr->dsize : 1);
+    if (!dict)
+        crash("couldn't allocate dictionary");
+    _zf_archive_load(ar, ar->nframes, dict, NULL, NULL);
+
+    ar->ddict = ZSTD_createDDict(dict, (size_t) fr->dsize);
+    if (!ar->ddict)
+        crash("couldn't create decompression dictionary");
+    free(dict);
+}
+
+static void _zf_archive_dctx(_zf_archive *ar, ZSTD_DCtx *dctx) {
+    if (ar->ddict)
+        ZSTD_DCtx_refDDict(dctx, ar->ddict);
+    if (ar->window_log && ZSTD_isError(ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, ar->window_log)))
+        crashfmt("archive needs a window of 2^%d bytes, more than zstd allows", ar->window_log);
+}
+
+static void _zf_read_legacy(zfolder *dir, FILE *f) {
+    z_fseek(f, 0, SEEK_SET);
+    _zf_dstream stream;
+    _zf_dstream_init(&stream, f);
+
+    uint32_t nfiles;
+    _zf_dstream_read(&stream, &nfiles, sizeof(nfiles));
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < nfiles; ++i) {
+        uint8_t plen;
+        uint32_t flen;
+        char path[UINT8_MAX + 1];
+        _zf_dstream_read(&stream, &plen, sizeof(plen));
+        _zf_dstream_read(&stream, &flen, sizeof(flen));
+        _zf_dstream_read(&stream, path, plen);
+        path[plen] = '\0';
+        zfile *file = _zf_new_file(dir, path);
+        file->flen = flen;
+        file->offset = offset;
+        offset += flen;
+    }
+
+    uint32_t dlen;
+    _zf_dstream_read(&stream, &dlen, sizeof(dlen));
+    if (offset > dlen)
+        crash("files are outside of the data");
+    _zf_reserve(dir, dlen);
+    _zf_dstream_read(&stream, dir->data + dir->dlen, dlen);
+    dir->dlen += dlen;
+    _zf_dstream_free(&stream);
+}
+
+static uint32_t _zf_archive_find_frame(_zf_archive *ar, uint64_t offset) {
+    uint32_t frame = _zf_frame_at(ar->doffsets, ar->nframes, offset);
+    if (frame >= ar->nframes)
+        crashfmt("offset %llu is not in any frame of the seek table", (unsigned long long) offset);
+    return frame;
+}
+
+static void _zf_archive_check(_zf_archive *ar, zfolder *dir) {
+    // the data frames have to add up to the data of the index
+    if (ar->doffsets[ar->nframes] != dir->dlen)
+        crash("seek table doesn't match the index");
+
+    // files and chunks are read from a single block, so each has to fit in one
+    _zf_chunk *chunks = (_zf_chunk *) dir->chunks;
+    for (uint32_t i = 0; i < dir->nchunks; ++i) {
+        uint32_t frame = _zf_archive_find_frame(ar, chunks[i].offset);
+        if (chunks[i].len > ar->doffsets[frame] + ar->frames[frame].dsize - chunks[i].offset)
+            crashfmt("chunk %u is split between frames", i);
+    }
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        zfile *file = &dir->files[i];
+        if (file->source == ZFILE_CHUNKED || file->flen == 0)
+            continue;
+        uint32_t frame = _zf_archive_find_frame(ar, file->offset);
+        if (file->flen > ar->doffsets[frame] + ar->frames[frame].dsize - file->offset)
+            crashfmt("file %s is split between frames", zf_get_path(dir, i));
+    }
+}
+
+static uint8_t *_zf_archive_block(_zf_archive *ar, uint32_t frame) {
+    if (ar->blocks[frame])
+        return ar->blocks[frame];
+
+    _zf_frame *fr = &ar->frames[frame];
+    if (fr->dsize > SIZE_MAX)
+        crash("block doesn't fit in memory");
+    // malloc(0) could return NULL, which means not decompressed yet
+    uint8_t *block = (uint8_t *) malloc(fr->dsize ? (size_t) fr->dsize : 1);
+    if (!block)
+        crash("couldn't allocate block");
+    _zf_archive_load(ar, frame, block, NULL, NULL);
+
+    ar->blocks[frame] = block;
+    return block;
+}
+
+static void _zf_archive_close(_zf_archive *ar) {
+    for (uint32_t i = 0; i < ar->nframes; ++i)
+        free(ar->blocks[i]);
+    free(ar->blocks);
+    free(ar->coffsets);
+    free(ar->doffsets);
+    free(ar->frames);
+    ZSTD_freeDDict(ar->ddict);
+    ZSTD_freeDCtx(ar->dctx);
+    fclose(ar->f);
+    free(ar);
+}
+
+static zfile *_zf_new_file(zfolder *dir, const char *path) {
+    size_t len = strlen(path);
+    if (len > UINT16_MAX)
+        crashfmt("path is too long -> %s", path);
+
+    _zf_reserve_files(dir, 1);
+    zfile *file = &dir->files[dir->nfiles++];
+    file->path = _zf_push_path(dir, path, len);
+    file->plen = (uint16_t) len;
+    file->source = ZFILE_DATA;
+    file->mtime = 0;
+    file->ino = 0;
+    return file;
+}
+
+static void _zf_set_stat(zfile *file, const z_stat_t *st) {
+    file->flen = (uint64_t) st->st_size;
+    file->mtime = z_mtime(*st);
+    file->ino = (uint64_t) st->st_ino;
+}
+
+#ifdef Z_MMAP
+static bool _zf_map_fd(zfolder *dir, zfile *file, int fd) {
+    if (file->flen < Z_MMAP_MIN_SIZE || file->flen == 0 || file->flen > SIZE_MAX)
+        return false;
+    void *ptr = mmap(NULL, (size_t) file->flen, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+        return false;
+    // the compressor reads it once from start to end
+    madvise(ptr, (size_t) file->flen, MADV_SEQUENTIAL);
+
+    file->source = ZFILE_MAPPED;
+    file->offset = _zf_push_map(dir, ptr, file->flen, true);
+    return true;
+}
+#endif
+
+static uint32_t _zf_push_map(zfolder *dir, void *ptr, uint64_t len, bool mapped) {
+    if (dir->nmaps == dir->mapcap)
+        dir->maps = _zf_grow(dir->maps, &dir->mapcap, dir->nmaps + 1, 16, sizeof(_zf_map));
+    _zf_map *map = &((_zf_map *) dir->maps)[dir->nmaps];
+    map->ptr = ptr;
+    map->len = len;
+    map->mapped = mapped;
+    return dir->nmaps++;
+}
+
+static void _zf_load_file(zfolder *dir, uint32_t index) {
+    zfile *file = &dir->files[index];
+    const char *path = zf_get_path(dir, index);
+    if (file->flen > SIZE_MAX)
+        crashfmt("%s doesn't fit in memory", path);
+    // a buffer of its own, so pointers returned before stay valid
+    uint8_t *data = (uint8_t *) malloc(file->flen ? (size_t) file->flen : 1);
     if (!data)
-        crashfmt("couldn't allocate data when reading %s", fname);
+        crashfmt("couldn't allocate data for %s", path);
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        crashfmt("couldn't open file -> %s", path);
+    _zf_fread(f, data, file->flen);
+    fclose(f);
+
+    file->source = ZFILE_MAPPED;
+    file->offset = _zf_push_map(dir, data, file->flen, false);
+}
+
+static uint64_t _zf_read_file(const char *path, zfolder *dir) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        crashfmt("couldn't open file -> %s", path);
+    uint64_t len = _zf_file_size(f);
+
+    // make sure there is enough space to read the new data
+    _zf_reserve(dir, len);
     // read data at the end of the buffer
-    fread(*data, len, 1, f);
+    _zf_fread(f, dir->data + dir->dlen, len);
+    dir->dlen += len;
 
     fclose(f);
     return len;
 }
 
-static void _write_whole_file(const char *path, uint8_t *data, size_t dlen) {
+static void _zf_reserve(zfolder *dir, uint64_t len) {
+    uint64_t needed = dir->dlen + len;
+    if (needed > SIZE_MAX)
+        crash("data doesn't fit in memory");
+    if (needed > dir->dcap)
+        dir->data = (uint8_t *) _zf_grow(dir->data, &dir->dcap, (size_t) needed, Z_MIN_DATA_CAP, 1);
+}
+
+static void _zf_reserve_files(zfolder *dir, uint32_t count) {
+    uint64_t needed = (uint64_t) dir->nfiles + count;
+    if (needed > UINT32_MAX)
+        crash("too many files");
+    if (needed > dir->fcap)
+        dir->files = (zfile *) _zf_grow(dir->files, &dir->fcap, (size_t) needed, Z_MIN_FILES_CAP, sizeof(zfile));
+}
+
+static void _zf_reserve_paths(zfolder *dir, size_t len) {
+    size_t needed = dir->pathlen + len;
+    if (needed > UINT32_MAX)
+        crash("paths are too long");
+    if (needed > dir->pathcap)
+        dir->paths = (char *) _zf_grow(dir->paths, &dir->pathcap, needed, Z_MIN_PATHS_CAP, 1);
+}
+
+static uint32_t _zf_push_path(zfolder *dir, const char *path, size_t len) {
+    _zf_reserve_paths(dir, len + 1);
+    uint32_t offset = (uint32_t) dir->pathlen;
+    memcpy(dir->paths + offset, path, len);
+    dir->paths[offset + len] = '\0';
+    dir->pathlen += len + 1;
+    return offset;
+}
+
+static void *_zf_grow(void *ptr, size_t *cap, size_t needed, size_t min_cap, size_t size) {
+    // grow geometrically, so that appending n
+    // elements doesn't copy the buffer n times
+    size_t new_cap = *cap ? *cap : min_cap;
+    while (new_cap < needed)
+        new_cap *= 2;
+
+    void *new_ptr = realloc(ptr, new_cap * size);
+    if (!new_ptr)
+        crashfmt("couldn't allocate %zu bytes", new_cap * size);
+    *cap = new_cap;
+    return new_ptr;
+}
+
+static char *_zf_path_buf(char *buf, size_t *cap, size_t len) {
+    // +1 for \0
+    if (len + 1 > *cap)
+        buf = (char *) _zf_grow(buf, cap, len + 1, 256, 1);
+    return buf;
+}
+
+static void _write_whole_file(const char *path, uint8_t *data, uint64_t dlen) {
     FILE *f = fopen(path, "wb");
     if (!f)
         crashfmt("couldn't open file -> %s", path);
-    fwrite(data, dlen, 1, f);
+    _zf_fwrite(f, data, dlen);
 
     fclose(f);
 }
 
-static void _concat_path(char *dst, const char *dir, const char *path, size_t path_length) {
-    strcpy(dst, path);
-    dst[path_length] = '/';
-    strcpy(dst + path_length + 1, dir);
+static void _zf_copy_range(const char *src, uint64_t offset, FILE *out, uint64_t len) {
+    FILE *in = fopen(src, "rb");
+    if (!in)
+        crashfmt("couldn't open file -> %s", src);
+    z_fseek(in, (z_off_t) offset, SEEK_SET);
+
+    const size_t chunk = 1 << 20;
+    uint8_t *buf = (uint8_t *) malloc(len < chunk ? (size_t) len + 1 : chunk);
+    if (!buf)
+        crashfmt("couldn't allocate buffer to copy %s", src);
+    while (len > 0) {
+        size_t n = len < chunk ? (size_t) len : chunk;
+        _zf_fread(in, buf, n);
+        _zf_fwrite(out, buf, n);
+        len -= n;
+    }
+
+    free(buf);
+    fclose(in);
 }
 
-static uint8_t _split_path(const char **path) {
-    const char *c = *path;
-    for (uint8_t len = 0; *c; c++, len++) {
-        if (*c == '/') {
-            *path += len + 1;
-            return len;
-        }
+// the temporary archive being written, only one at a time
+static char *_zf_pending_temp = NULL;
+
+static char *_zf_temp_path(const char *path) {
+    size_t len = strlen(path);
+    char *out = (char *) malloc(len + sizeof(".tmp"));
+    if (!out)
+        crash("couldn't allocate path");
+    memcpy(out, path, len);
+    memcpy(out + len, ".tmp", sizeof(".tmp"));
+
+    static bool registered = false;
+    if (!registered)
+        registered = atexit(_zf_temp_cleanup) == 0;
+    _zf_pending_temp = out;
+    return out;
+}
+
+static void _zf_temp_replace(char *tmp, const char *path) {
+#ifdef Z_WINDOWS
+    bool ok = MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool ok = rename(tmp, path) == 0;
+#endif
+    if (!ok)
+        crashfmt("couldn't rename %s to %s", tmp, path);
+    _zf_pending_temp = NULL;
+    free(tmp);
+}
+
+static void _zf_temp_cleanup(void) {
+    if (_zf_pending_temp)
+        remove(_zf_pending_temp);
+}
+
+static void _zf_fread(FILE *f, void *data, uint64_t len) {
+    uint8_t *buf = (uint8_t *) data;
+    while (len > 0) {
+        size_t n = len > Z_IO_CHUNK ? Z_IO_CHUNK : (size_t) len;
+        if (fread(buf, 1, n, f) != n)
+            crash("couldn't read from file");
+        buf += n;
+        len -= n;
     }
-    return 0;
 }
 
-static void _create_necessary_dirs(const char *path) {
-    // TODO check if the path exists before actually
-    // trying every combination
+static void _zf_fwrite(FILE *f, const void *data, uint64_t len) {
+    const uint8_t *buf = (const uint8_t *) data;
+    while (len > 0) {
+        size_t n = len > Z_IO_CHUNK ? Z_IO_CHUNK : (size_t) len;
+        if (fwrite(buf, 1, n, f) != n)
+            crash("couldn't write to file");
+        buf += n;
+        len -= n;
+    }
+}
 
-    const char *tmp_path = path;
+static uint64_t _zf_file_size(FILE *f) {
+    z_fseek(f, 0, SEEK_END);
+    z_off_t len = z_ftell(f);
+    if (len < 0)
+        crash("length of file is negative");
+    z_fseek(f, 0, SEEK_SET);
+    return (uint64_t) len;
+}
 
-    struct stat st = { 0 };
-    uint8_t len = 0;
-    char buf[Z_MAX_PATH_LEN];
-    while ((len = _split_path(&tmp_path))) {
-        size_t sz = (tmp_path - 1) - path;
-        if (sz > Z_MAX_PATH_LEN)
-            crashfmt("%zu is more than the maximum path length: %u\n", sz, Z_MAX_PATH_LEN);
-        strncpy(buf, path, sz);
-        buf[sz] = '\0';
+static size_t _zf_put_varint(uint8_t *buf, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        buf[len++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (uint8_t) value;
+    return len;
+}
 
-        if (stat(buf, &st) == -1)
-            _create_dir(buf);
+static uint64_t _zf_get_varint(uint8_t **buf, uint8_t *end) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (*buf >= end)
+            crash("varint goes past the end of the buffer");
+        uint8_t byte = *(*buf)++;
+        value |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return value;
     }
+    crash("varint is too long");
 }
 
-static void _create_dir(const char *path) {
-#ifdef Z_WINDOWS
-    _mkdir(path);
-#elif defined(Z_LINUX)
-    mkdir(path, 0777);
-#endif
+static size_t _zf_varint_size(uint64_t value) {
+    size_t len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++len;
+    }
+    return len;
+}
+
+static void _concat_path(char *dst, const char *dir, const char *path, size_t path_length) {
+    strcpy(dst, path);
+    dst[path_length] = '/';
+    strcpy(dst + path_length + 1, dir);
+}
+
+static void _zf_dirents_path(_zf_dirents *d, const char *path) {
+    d->plen = strlen(path);
+    d->cap = 0;
+    d->path = _zf_path_buf(NULL, &d->cap, d->plen + 1);
+    memcpy(d->path, path, d->plen);
+    d->path[d->plen] = '/';
+    d->path[d->plen + 1] = '\0';
 }
 
+static void _zf_dirents_open(_zf_dirents *d, const char *path) {
+#ifdef Z_DIRFD
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        crashfmt("couldn't open directory -> %s", path);
+    _zf_dirents_at(d, fd, path);
+    d->own_fd = true;
+#else
+    d->d = opendir(path);
+    if (!d->d)
+        crashfmt("couldn't open directory -> %s", path);
+    _zf_dirents_path(d, path);
+#endif
+}
+
+#ifdef Z_DIRFD
+static void _zf_dirents_at(_zf_dirents *d, int fd, const char *path) {
+    d->fd = fd;
+    d->own_fd = false;
+    d->buf = (uint8_t *) malloc(Z_GETDENTS_BUF);
+    if (!d->buf)
+        crash("couldn't allocate getdents buffer");
+    d->len = 0;
+    d->pos = 0;
+    _zf_dirents_path(d, path);
+}
+#endif
+
+static const char *_zf_dirents_next(_zf_dirents *d, unsigned char *type) {
+    while (true) {
+#ifdef Z_DIRFD
+        if (d->pos == d->len) {
+            d->len = syscall(SYS_getdents64, d->fd, d->buf, Z_GETDENTS_BUF);
+            if (d->len < 0)
+                crashfmt("couldn't read directory -> %.*s", (int) d->plen, d->path);
+            d->pos = 0;
+            if (d->len == 0)
+                return NULL;
+        }
+        _zf_dirent64 *ent = (_zf_dirent64 *) (d->buf + d->pos);
+        d->pos += ent->d_reclen;
+#else
+        struct dirent *ent = readdir(d->d);
+        if (!ent)
+            return NULL;
+#endif
+        // "." is the current directory, ".." is the previous directory
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        *type = ent->d_type;
+        // not every filesystem fills d_type
+        if (*type == DT_UNKNOWN) {
+            z_stat_t st;
+            if (!_zf_dirents_stat(d, ent->d_name, &st))
+                continue;
+            *type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (*type == DT_DIR || *type == DT_REG)
+            return ent->d_name;
+    }
+}
+
+static bool _zf_dirents_stat(_zf_dirents *d, const char *name, z_stat_t *st) {
+#ifdef Z_DIRFD
+    return fstatat(d->fd, name, st, AT_SYMLINK_NOFOLLOW) == 0;
+#else
+    size_t nlen = strlen(name);
+    d->path = _zf_path_buf(d->path, &d->cap, d->plen + 1 + nlen);
+    memcpy(d->path + d->plen + 1, name, nlen + 1);
+    bool ok = z_lstat(d->path, st) == 0;
+    d->path[d->plen + 1] = '\0';
+    return ok;
+#endif
+}
+
+static void _zf_dirents_close(_zf_dirents *d) {
+#ifdef Z_DIRFD
+    if (d->own_fd)
+        close(d->fd);
+    free(d->buf);
+#else
+    closedir(d->d);
+#endif
+    free(d->path);
+}
+
+#ifdef Z_DIRFD
+static void _zf_add_dir_at(_zf_dirwalk *w, int fd, size_t len) {
+    zfolder *dir = w->dir;
+    // every level has its own buffer, the walk recurses
+    // before the current one has been fully consumed
+    _zf_dirents d;
+    _zf_dirents_at(&d, fd, w->path);
+
+    const char *name;
+    unsigned char type;
+    while ((name = _zf_dirents_next(&d, &type)) != NULL) {
+        if (type == DT_DIR && !w->recursive)
+            continue;
+
+        // get final path length (path/dir)
+        size_t nlen = strlen(name);
+        w->path = _zf_path_buf(w->path, &w->cap, len + 1 + nlen);
+        w->path[len] = '/';
+        memcpy(w->path + len + 1, name, nlen + 1);
+
+        if (dir->lazy && type == DT_REG) {
+            z_stat_t st;
+            if (!_zf_dirents_stat(&d, name, &st))
+                crashfmt("couldn't stat file -> %s", w->path);
+            zfile *file = _zf_new_file(dir, w->path);
+            _zf_set_stat(file, &st);
+            file->offset = 0;
+            file->source = ZFILE_DISK;
+            w->path[len] = '\0';
+            continue;
+        }
+
+#ifdef Z_URING
+        if (w->use_ring && type == DT_REG) {
+            // only the entry is added, the file is read with the rest of the batch
+            _zf_new_file(dir, w->path);
+            w->batch[w->nbatch++] = dir->nfiles - 1;
+            if (w->nbatch == Z_URING_BATCH)
+                _zf_dirwalk_flush(w, fd, len);
+            w->path[len] = '\0';
+            continue;
+        }
+        // the data of the batch goes before the files in the subdirectory
+        if (w->nbatch > 0)
+            _zf_dirwalk_flush(w, fd, len);
+#endif
+
+        int flags = O_RDONLY | O_CLOEXEC | O_NOFOLLOW | (type == DT_DIR ? O_DIRECTORY : 0);
+        int child = openat(fd, name, flags);
+        if (child < 0)
+            crashfmt("couldn't open -> %s", w->path);
+
+        if (type == DT_DIR) {
+            _zf_add_dir_at(w, child, len + 1 + nlen);
+        }
+        else {
+            struct stat st;
+            if (fstat(child, &st) != 0)
+                crashfmt("couldn't stat file -> %s", w->path);
+            zfile *file = _zf_new_file(dir, w->path);
+            file->offset = dir->dlen;
+            _zf_set_stat(file, &st);
+#ifdef Z_MMAP
+            if (_zf_map_fd(dir, file, child)) {
+                close(child);
+                w->path[len] = '\0';
+                continue;
+            }
+#endif
+            _zf_reserve(dir, file->flen);
+            _zf_read_fd(child, dir->data + file->offset, file->flen, w->path);
+            dir->dlen += file->flen;
+        }
+        close(child);
+        w->path[len] = '\0';
+    }
+
+#ifdef Z_URING
+    if (w->nbatch > 0)
+        _zf_dirwalk_flush(w, fd, len);
+#endif
+    _zf_dirents_close(&d);
+}
+
+static void _zf_read_fd(int fd, uint8_t *data, uint64_t len, const char *path) {
+    while (len > 0) {
+        size_t n = len > Z_IO_CHUNK ? Z_IO_CHUNK : (size_t) len;
+        ssize_t r = read(fd, data, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            crashfmt("couldn't read from file -> %s", path);
+        data += r;
+        len -= (uint64_t) r;
+    }
+}
+
+#ifdef Z_URING
+static void _zf_dirwalk_flush(_zf_dirwalk *w, int fd, size_t len) {
+    zfolder *dir = w->dir;
+    unsigned n = w->nbatch;
+    w->nbatch = 0;
+    // the paths are in the pool, the name starts after the directory
+    const char *names[Z_URING_BATCH];
+    for (unsigned k = 0; k < n; ++k)
+        names[k] = zf_get_path(dir, w->batch[k]) + len + 1;
+
+    for (unsigned k = 0; k < n; ++k) {
+        struct io_uring_sqe *sqe = _zf_uring_sqe(&w->ring);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) names[k];
+        sqe->len = STATX_SIZE | STATX_MTIME | STATX_INO;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->off = (uint64_t) (uintptr_t) &w->stx[k];
+        sqe->user_data = k;
+    }
+    struct io_uring_cqe cqes[Z_URING_BATCH * 3];
+    _zf_uring_wait(&w->ring, cqes, n);
+    for (unsigned k = 0; k < n; ++k) {
+        if (cqes[k].res < 0)
+            crashfmt("couldn't stat file -> %s (%s)", zf_get_path(dir, w->batch[cqes[k].user_data]), strerror(-cqes[k].res));
+    }
+
+    // reserve the whole batch at once, every file is read into its own slot
+    uint64_t total = 0;
+    for (unsigned k = 0; k < n; ++k) {
+        zfile *file = &dir->files[w->batch[k]];
+        file->flen = w->stx[k].stx_size;
+        file->mtime = (uint64_t) w->stx[k].stx_mtime.tv_sec * 1000000000 + w->stx[k].stx_mtime.tv_nsec;
+        file->ino = w->stx[k].stx_ino;
+#ifdef Z_MMAP
+        if (file->flen >= Z_MMAP_MIN_SIZE) {
+            int child = openat(fd, names[k], O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            bool mapped = child >= 0 && _zf_map_fd(dir, file, child);
+            if (child >= 0)
+                close(child);
+            if (mapped)
+                continue;
+        }
+#endif
+        file->offset = dir->dlen + total;
+        total += file->flen;
+    }
+    _zf_reserve(dir, total);
+    dir->dlen += total;
+
+    unsigned count = 0;
+    for (unsigned k = 0; k < n; ++k) {
+        zfile *file = &dir->files[w->batch[k]];
+        if (file->source == ZFILE_MAPPED)
+            continue;
+
+        if (file->flen > Z_URING_MAX_FILE) {
+            const char *path = zf_get_path(dir, w->batch[k]);
+            int child = openat(fd, names[k], O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            if (child < 0)
+                crashfmt("couldn't open -> %s", path);
+            _zf_read_fd(child, dir->data + file->offset, file->flen, path);
+            close(child);
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = _zf_uring_sqe(&w->ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) names[k];
+        // direct descriptors don't accept O_CLOEXEC
+        sqe->open_flags = O_RDONLY | O_NOFOLLOW;
+        sqe->file_index = k + 1;
+        sqe->user_data = (uint64_t) k << 2;
+
+        sqe = _zf_uring_sqe(&w->ring);
+        sqe->opcode = IORING_OP_READ;
+        sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+        sqe->fd = (int) k;
+        sqe->addr = (uint64_t) (uintptr_t) (dir->data + file->offset);
+        sqe->len = (uint32_t) file->flen;
+        sqe->user_data = (uint64_t) k << 2 | 1;
+
+        sqe = _zf_uring_sqe(&w->ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = k + 1;
+        sqe->user_data = (uint64_t) k << 2 | 2;
+        count += 3;
+    }
+    if (count == 0)
+        return;
+
+    _zf_uring_wait(&w->ring, cqes, count);
+    for (unsigned i = 0; i < count; ++i) {
+        // user_data is the batch slot and the operation (0 open, 1 read, 2 close)
+        uint32_t index = w->batch[cqes[i].user_data >> 2];
+        bool is_read = (cqes[i].user_data & 3) == 1;
+        // linked requests after a failed one are canceled
+        if (cqes[i].res < 0)
+            crashfmt("couldn't read file -> %s (%s)", zf_get_path(dir, index), strerror(-cqes[i].res));
+        if (is_read && (uint64_t) cqes[i].res != dir->files[index].flen)
+            crashfmt("file changed while it was being added -> %s", zf_get_path(dir, index));
+    }
+}
+#endif
+#endif
+
+static void _zf_create_dirs(zfolder *dir, const char *output, size_t outlen) {
+    _zf_dirname *names = NULL;
+    size_t count = 0, cap = 0;
+
+    const char *prev = NULL;
+    size_t prev_len = 0;
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        const char *path = zf_get_path(dir, i);
+        const char *slash = strrchr(path, '/');
+        if (!slash)
+            continue;
+        size_t len = (size_t) (slash - path);
+        // files in the same directory are usually next to each other
+        if (prev && len == prev_len && memcmp(path, prev, len) == 0)
+            continue;
+        prev = path;
+        prev_len = len;
+
+        // every prefix of the directory, the duplicates are removed after sorting
+        for (size_t j = 1; j <= len; ++j) {
+            if (j < len && path[j] != '/')
+                continue;
+            if (count == cap)
+                names = (_zf_dirname *) _zf_grow(names, &cap, count + 1, 64, sizeof(_zf_dirname));
+            names[count].path = path;
+            names[count].len = j;
+            count++;
+        }
+    }
+    if (count == 0)
+        return;
+    qsort(names, count, sizeof(_zf_dirname), _zf_dirname_cmp);
+
+    char *temp_path = NULL;
+    size_t temp_cap = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0 && _zf_dirname_cmp(&names[i - 1], &names[i]) == 0)
+            continue;
+
+        temp_path = _zf_path_buf(temp_path, &temp_cap, outlen + 1 + names[i].len);
+        memcpy(temp_path, output, outlen);
+        temp_path[outlen] = '/';
+        memcpy(temp_path + outlen + 1, names[i].path, names[i].len);
+        temp_path[outlen + 1 + names[i].len] = '\0';
+        _create_dir(temp_path);
+    }
+
+    free(temp_path);
+    free(names);
+}
+
+static int _zf_dirname_cmp(const void *a, const void *b) {
+    const _zf_dirname *da = (const _zf_dirname *) a;
+    const _zf_dirname *db = (const _zf_dirname *) b;
+    size_t len = da->len < db->len ? da->len : db->len;
+    int res = memcmp(da->path, db->path, len);
+    if (res != 0)
+        return res;
+    // a prefix comes before the longer path
+    return (da->len > db->len) - (da->len < db->len);
+}
+
+static void _create_dir(const char *path) {
+#ifdef Z_WINDOWS
+    _mkdir(path);
+#elif defined(Z_LINUX)
+    mkdir(path, 0777);
+#endif
+}
+
+static int _zf_cpu_count(void) {
+#if defined(__linux__) && defined(SYS_sched_getaffinity)
+    // respects taskset and cgroup cpusets, which the number of online
+    // cpus doesn't, the raw syscall doesn't need _GNU_SOURCE and
+    // returns the size of the mask it filled
+    unsigned long mask[64];
+    long len = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+    int count = 0;
+    for (long i = 0; i < len / (long) sizeof(unsigned long); ++i)
+        count += __builtin_popcountl(mask[i]);
+    if (count > 0)
+        return count;
+#endif
+#ifdef Z_WINDOWS
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int) info.dwNumberOfProcessors;
+#elif defined(Z_LINUX)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+#else
+    return 1;
+#endif
+}
+
+#ifdef Z_WINDOWS
+typedef struct {
+    void *(*fn)(void *);
+    void *arg;
+} _zf_thread_start;
+
+static DWORD WINAPI _zf_thread_main(LPVOID param) {
+    _zf_thread_start *start = (_zf_thread_start *) param;
+    start->fn(start->arg);
+    return 0;
+}
+
+static void _zf_mutex_init(_zf_mutex *m)   { InitializeCriticalSection(m); }
+static void _zf_mutex_lock(_zf_mutex *m)   { EnterCriticalSection(m); }
+static void _zf_mutex_unlock(_zf_mutex *m) { LeaveCriticalSection(m); }
+static void _zf_mutex_free(_zf_mutex *m)   { DeleteCriticalSection(m); }
+static void _zf_cond_init(_zf_cond *c)      { InitializeConditionVariable(c); }
+static void _zf_cond_wait(_zf_cond *c, _zf_mutex *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void _zf_cond_signal(_zf_cond *c)    { WakeConditionVariable(c); }
+static void _zf_cond_broadcast(_zf_cond *c) { WakeAllConditionVariable(c); }
+static void _zf_cond_free(_zf_cond *c)      { (void) c; }
+#else
+static void _zf_mutex_init(_zf_mutex *m)   { pthread_mutex_init(m, NULL); }
+static void _zf_mutex_lock(_zf_mutex *m)   { pthread_mutex_lock(m); }
+static void _zf_mutex_unlock(_zf_mutex *m) { pthread_mutex_unlock(m); }
+static void _zf_mutex_free(_zf_mutex *m)   { pthread_mutex_destroy(m); }
+static void _zf_cond_init(_zf_cond *c)      { pthread_cond_init(c, NULL); }
+static void _zf_cond_wait(_zf_cond *c, _zf_mutex *m) { pthread_cond_wait(c, m); }
+static void _zf_cond_signal(_zf_cond *c)    { pthread_cond_signal(c); }
+static void _zf_cond_broadcast(_zf_cond *c) { pthread_cond_broadcast(c); }
+static void _zf_cond_free(_zf_cond *c)      { pthread_cond_destroy(c); }
+#endif
+
+static void _zf_run_threads(int nthreads, void *(*fn)(void *), void *args, size_t arg_size) {
+    uint8_t *arg = (uint8_t *) args;
+    if (nthreads <= 1) {
+        fn(arg);
+        return;
+    }
+
+#ifdef Z_WINDOWS
+    HANDLE *threads = (HANDLE *) malloc(nthreads * sizeof(HANDLE));
+    _zf_thread_start *starts = (_zf_thread_start *) malloc(nthreads * sizeof(_zf_thread_start));
+    if (!threads || !starts)
+        crash("couldn't allocate threads");
+    for (int i = 1; i < nthreads; ++i) {
+        starts[i].fn = fn;
+        starts[i].arg = arg + i * arg_size;
+        threads[i] = CreateThread(NULL, 0, _zf_thread_main, &starts[i], 0, NULL);
+        if (!threads[i])
+            crash("couldn't create thread");
+    }
+    fn(arg);
+    for (int i = 1; i < nthreads; ++i) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    free(starts);
+#else
+    pthread_t *threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    if (!threads)
+        crash("couldn't allocate threads");
+    for (int i = 1; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, fn, arg + i * arg_size) != 0)
+            crash("couldn't create thread");
+    }
+    fn(arg);
+    for (int i = 1; i < nthreads; ++i)
+        pthread_join(threads[i], NULL);
+#endif
+    free(threads);
+}
+
+static void _zf_deque_push(_zf_deque *q, char *path) {
+    _zf_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        // reuse the space left by stolen directories before growing
+        if (q->head > 0) {
+            memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof(char *));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        if (q->tail == q->cap)
+            q->dirs = (char **) _zf_grow(q->dirs, &q->cap, q->cap + 1, 64, sizeof(char *));
+    }
+    q->dirs[q->tail++] = path;
+    _zf_mutex_unlock(&q->lock);
+}
+
+static char *_zf_deque_pop(_zf_deque *q) {
+    char *path = NULL;
+    _zf_mutex_lock(&q->lock);
+    if (q->tail > q->head)
+        path = q->dirs[--q->tail];
+    _zf_mutex_unlock(&q->lock);
+    return path;
+}
+
+static char *_zf_deque_steal(_zf_deque *q) {
+    char *path = NULL;
+    _zf_mutex_lock(&q->lock);
+    if (q->tail > q->head)
+        path = q->dirs[q->head++];
+    _zf_mutex_unlock(&q->lock);
+    return path;
+}
+
+static void _zf_walk_push(_zf_walker *w, char *path) {
+    // count it before it can be stolen, so that pending
+    // never reaches 0 while there is still work to do
+    _zf_mutex_lock(&w->walk->lock);
+    w->walk->pending++;
+    _zf_mutex_unlock(&w->walk->lock);
+    _zf_deque_push(&w->deque, path);
+
+    // counted once it can be stolen, an idle walker that saw
+    // the previous count is going to look at the deques again
+    _zf_mutex_lock(&w->walk->lock);
+    w->walk->pushes++;
+    _zf_cond_signal(&w->walk->wake);
+    _zf_mutex_unlock(&w->walk->lock);
+}
+
+static void _zf_walk_dir(_zf_walker *w, const char *path) {
+    _zf_dirents d;
+    _zf_dirents_open(&d, path);
+
+    size_t plen = strlen(path);
+    const char *name;
+    unsigned char type;
+    while ((name = _zf_dirents_next(&d, &type)) != NULL) {
+        if (type == DT_DIR && !w->walk->recursive)
+            continue;
+
+        // get final path length (path/dir)
+        size_t dlen = strlen(name) + plen + 1;
+        char *child = (char *) malloc(dlen + 1);
+        if (!child)
+            crash("couldn't allocate path");
+        _concat_path(child, name, path, plen);
+
+        if (type == DT_DIR) {
+            _zf_walk_push(w, child);
+            continue;
+        }
+
+        z_stat_t st;
+        if (!_zf_dirents_stat(&d, name, &st))
+            crashfmt("couldn't stat file -> %s", child);
+        if (w->nentries == w->cap)
+            w->entries = (_zf_entry *) _zf_grow(w->entries, &w->cap, w->cap + 1, 64, sizeof(_zf_entry));
+        w->entries[w->nentries].path = child;
+        w->entries[w->nentries].size = (uint64_t) st.st_size;
+        w->entries[w->nentries].mtime = z_mtime(st);
+        w->entries[w->nentries].ino = (uint64_t) st.st_ino;
+        w->nentries++;
+    }
+    _zf_dirents_close(&d);
+}
+
+static void *_zf_walk_worker(void *arg) {
+    _zf_walker *w = (_zf_walker *) arg;
+    _zf_walk *walk = w->walk;
+
+    while (true) {
+        _zf_mutex_lock(&walk->lock);
+        uint64_t seen = walk->pushes;
+        _zf_mutex_unlock(&walk->lock);
+
+        char *path = _zf_deque_pop(&w->deque);
+        // nothing left locally, try to steal from the others
+        for (int i = 1; !path && i < walk->nwalkers; ++i)
+            path = _zf_deque_steal(&walk->walkers[(w->id + i) % walk->nwalkers].deque);
+
+        if (!path) {
+            // somebody is still walking and could push more directories,
+            // wait for a push after the deques were looked at, or the end
+            _zf_mutex_lock(&walk->lock);
+            while (walk->pending > 0 && walk->pushes == seen)
+                _zf_cond_wait(&walk->wake, &walk->lock);
+            bool done = walk->pending == 0;
+            _zf_mutex_unlock(&walk->lock);
+            if (done)
+                break;
+            continue;
+        }
+
+        _zf_walk_dir(w, path);
+        free(path);
+
+        _zf_mutex_lock(&walk->lock);
+        if (--walk->pending == 0)
+            _zf_cond_broadcast(&walk->wake);
+        _zf_mutex_unlock(&walk->lock);
+    }
+    return NULL;
+}
+
+static void *_zf_read_worker(void *arg) {
+    _zf_walker *w = (_zf_walker *) arg;
+    _zf_walk *walk = w->walk;
+    zfolder *dir = walk->dir;
+
+    while (true) {
+        _zf_mutex_lock(&walk->lock);
+        uint32_t i = walk->next < walk->end ? walk->next++ : walk->end;
+        _zf_mutex_unlock(&walk->lock);
+        if (i == walk->end)
+            break;
+
+        // every file has its own slot in the data, so there is no need to lock
+        zfile *file = &dir->files[i];
+        if (file->source != ZFILE_DATA)
+            continue;
+        const char *path = zf_get_path(dir, i);
+        FILE *f = fopen(path, "rb");
+        if (!f)
+            crashfmt("couldn't open file -> %s", path);
+        if (_zf_file_size(f) != file->flen)
+            crashfmt("file changed while it was being added -> %s", path);
+        _zf_fread(f, dir->data + file->offset, file->flen);
+        fclose(f);
+    }
+    return NULL;
+}
+
+static int _zf_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const _zf_entry *) a)->path, ((const _zf_entry *) b)->path);
+}
+
+static void *_zf_extract_worker(void *arg) {
+    _zf_extractor *w = (_zf_extractor *) arg;
+    _zf_extract *ex = w->ex;
+    zfolder *dir = ex->dir;
+    _zf_archive *ar = (_zf_archive *) dir->archive;
+
+    uint8_t *block = NULL;
+    size_t block_cap = 0;
+    while (true) {
+        _zf_mutex_lock(&ex->lock);
+        uint32_t job = ex->next < ex->njobs ? ex->next++ : ex->njobs;
+        _zf_mutex_unlock(&ex->lock);
+        if (job == ex->njobs)
+            break;
+
+        if (!ar) {
+            if (dir->files[job].source != ZFILE_CHUNKED)
+                _zf_extract_write(w, job, zf_get_file(dir, job));
+            continue;
+        }
+
+        uint32_t first = ex->first[job], last = ex->first[job + 1];
+        if (first == last)
+            continue;
+
+        // blocks already requested with zf_get_file are reused, the
+        // others are decompressed in a buffer owned by this thread
+        uint8_t *data = ar->blocks[job];
+        if (!data) {
+            _zf_frame *fr = &ar->frames[job];
+            if (fr->dsize > SIZE_MAX)
+                crash("block doesn't fit in memory");
+            if (fr->dsize > block_cap)
+                block = (uint8_t *) _zf_grow(block, &block_cap, (size_t) fr->dsize, 1 << 20, 1);
+            if (!w->dctx && !(w->dctx = ZSTD_createDCtx()))
+                crash("couldn't create decompression context");
+            _zf_archive_load(ar, job, block, w->dctx, &ex->lock);
+            data = block;
+        }
+
+        for (uint32_t i = first; i < last; ++i) {
+            uint32_t index = ex->order[i];
+            _zf_extract_write(w, index, data + (dir->files[index].offset - ar->doffsets[job]));
+        }
+    }
+    free(block);
+    return NULL;
+}
+
+static void _zf_extract_write(_zf_extractor *w, uint32_t index, const uint8_t *data) {
+    _zf_extract *ex = w->ex;
+    zfile *file = &ex->dir->files[index];
+
+    size_t path_len = file->plen + ex->outlen + 1;
+    w->path = _zf_path_buf(w->path, &w->cap, path_len);
+    _concat_path(w->path, zf_get_path(ex->dir, index), ex->output, ex->outlen);
+
+    _write_whole_file(w->path, (uint8_t *) data, file->flen);
+}
+
+static void _zf_archive_load(_zf_archive *ar, uint32_t frame, uint8_t *block, ZSTD_DCtx *dctx, _zf_mutex *lock) {
+    _zf_frame *fr = &ar->frames[frame];
+    if (fr->csize > SIZE_MAX || fr->dsize > SIZE_MAX)
+        crash("block doesn't fit in memory");
+    uint8_t *compressed = (uint8_t *) malloc(fr->csize ? (size_t) fr->csize : 1);
+    if (!compressed)
+        crash("couldn't allocate block");
+
+    if (lock)
+        _zf_mutex_lock(lock);
+    z_fseek(ar->f, (z_off_t) ar->coffsets[frame], SEEK_SET);
+    _zf_fread(ar->f, compressed, fr->csize);
+    if (lock)
+        _zf_mutex_unlock(lock);
+
+    // the archive context is only used from the thread that owns it
+    if (!dctx) {
+        if (!ar->dctx && !(ar->dctx = ZSTD_createDCtx()))
+            crash("couldn't create decompression context");
+        dctx = ar->dctx;
+    }
+    // ddict is still NULL while the dictionary frame itself is loaded
+    size_t res = ZSTD_decompress_usingDDict(dctx, block, (size_t) fr->dsize, compressed, (size_t) fr->csize, ar->ddict);
+    if (ZSTD_isError(res) || res != fr->dsize)
+        crash("couldn't decompress block");
+    free(compressed);
+}
+
+#ifdef Z_URING
+static bool _zf_uring_init(_zf_uring *ring, unsigned entries, unsigned nfiles, const uint8_t *ops, unsigned nops) {
+    memset(ring, 0, sizeof(_zf_uring));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return false;
+    ring->fd = fd;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // since 5.4 both rings live in the same mapping
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_size > ring->sq_size)
+        ring->sq_size = ring->cq_size;
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = single ? ring->sq_ptr
+        : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        _zf_uring_free(ring);
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *) ring->sq_ptr;
+    uint8_t *cq = (uint8_t *) ring->cq_ptr;
+    ring->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->cq_head  = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    ring->tail     = *ring->sq_tail;
+
+    // empty slots for the direct descriptors (a sparse table needs 5.5)
+    int *fds = (int *) malloc(nfiles * sizeof(int));
+    if (!fds)
+        crash("couldn't allocate io_uring files");
+    for (unsigned i = 0; i < nfiles; ++i)
+        fds[i] = -1;
+    int res = (int) syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, fds, nfiles);
+    free(fds);
+    if (res < 0 || !_zf_uring_supports(ring, ops, nops) || !_zf_uring_direct(ring)) {
+        _zf_uring_free(ring);
+        return false;
+    }
+
+    return true;
+}
+
+static bool _zf_uring_supports(_zf_uring *ring, const uint8_t *ops, unsigned nops) {
+    // the probe needs 5.6, as do openat, read, write, close and statx
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, size);
+    if (!probe)
+        crash("couldn't allocate io_uring probe");
+    bool supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+    for (unsigned k = 0; k < nops && supported; ++k)
+        supported = ops[k] <= probe->last_op && (probe->ops[ops[k]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+static bool _zf_uring_direct(_zf_uring *ring) {
+    // opening into a slot needs 5.15, before that file_index is ignored and
+    // a normal descriptor is returned, then the read of the empty slot fails
+    // and the close linked to it (which would close sqe->fd) is canceled
+    struct io_uring_sqe *sqe = _zf_uring_sqe(ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) "/dev/null";
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = 1;
+    sqe->user_data = 0;
+
+    // empty, a short read would cancel the close
+    char buf[1];
+    sqe = _zf_uring_sqe(ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = 0;
+    sqe->user_data = 1;
+
+    sqe = _zf_uring_sqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+    sqe->user_data = 2;
+
+    struct io_uring_cqe cqes[3];
+    _zf_uring_wait(ring, cqes, 3);
+    int res[3] = { -1, -1, -1 };
+    for (int k = 0; k < 3; ++k)
+        res[cqes[k].user_data] = cqes[k].res;
+    if (res[0] >= 0 && res[1] < 0)
+        close(res[0]);
+    return res[0] == 0 && res[1] == 0 && res[2] == 0;
+}
+
+static void _zf_uring_free(_zf_uring *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+static struct io_uring_sqe *_zf_uring_sqe(_zf_uring *ring) {
+    unsigned index = ring->tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->tail++;
+    ring->queued++;
+    return sqe;
+}
+
+static void _zf_uring_submit(_zf_uring *ring, unsigned wait_nr) {
+    // the kernel must see the sqes before the new tail
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    while (ring->queued > 0 || wait_nr > 0) {
+        long res = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait_nr, flags, NULL, 0);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            crashfmt("io_uring_enter failed -> %s", strerror(errno));
+        ring->queued -= (unsigned) res;
+        break;
+    }
+}
+
+static bool _zf_uring_cqe(_zf_uring *ring, struct io_uring_cqe *cqe) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void _zf_uring_wait(_zf_uring *ring, struct io_uring_cqe *cqes, unsigned count) {
+    _zf_uring_submit(ring, count);
+    for (unsigned done = 0; done < count;) {
+        if (_zf_uring_cqe(ring, &cqes[done]))
+            done++;
+        else
+            _zf_uring_submit(ring, 1);
+    }
+}
+
+static bool _zf_uring_write_files(zfolder *dir, const char *output, size_t outlen) {
+    // open, write and close of a file are linked, so a whole
+    // batch of files goes to the kernel with a single syscall
+    static const uint8_t ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE };
+    _zf_uring ring;
+    if (!_zf_uring_init(&ring, Z_URING_BATCH * 4, Z_URING_BATCH, ops, sizeof(ops)))
+        return false;
+
+    char *paths[Z_URING_BATCH] = { 0 };
+    size_t caps[Z_URING_BATCH] = { 0 };
+    char *temp_path = NULL;
+    size_t temp_cap = 0;
+
+    uint32_t i = 0;
+    while (i < dir->nfiles) {
+        unsigned slot = 0;
+        for (; slot < Z_URING_BATCH && i < dir->nfiles; ++i) {
+            zfile *file = &dir->files[i];
+            // chunked files aren't in one buffer
+            if (file->flen > Z_URING_MAX_FILE || file->source == ZFILE_CHUNKED) {
+                size_t path_len = file->plen + outlen + 1;
+                temp_path = _zf_path_buf(temp_path, &temp_cap, path_len);
+                _concat_path(temp_path, zf_get_path(dir, i), output, outlen);
+                _zf_write_file(dir, i, temp_path);
+                continue;
+            }
+            uint8_t *data = zf_get_file(dir, i);
+
+            paths[slot] = _zf_path_buf(paths[slot], &caps[slot], file->plen + outlen + 1);
+            _concat_path(paths[slot], zf_get_path(dir, i), output, outlen);
+
+            struct io_uring_sqe *sqe = _zf_uring_sqe(&ring);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t) (uintptr_t) paths[slot];
+            sqe->len = 0666;
+            // direct descriptors don't accept O_CLOEXEC
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+            sqe->file_index = slot + 1;
+            sqe->user_data = (uint64_t) i << 2;
+
+            sqe = _zf_uring_sqe(&ring);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+            sqe->fd = (int) slot;
+            sqe->addr = (uint64_t) (uintptr_t) data;
+            sqe->len = (uint32_t) file->flen;
+            sqe->user_data = (uint64_t) i << 2 | 1;
+
+            sqe = _zf_uring_sqe(&ring);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = slot + 1;
+            sqe->user_data = (uint64_t) i << 2 | 2;
+
+            slot++;
+        }
+        if (slot == 0)
+            continue;
+
+        struct io_uring_cqe cqes[Z_URING_BATCH * 3];
+        _zf_uring_wait(&ring, cqes, slot * 3);
+        for (unsigned k = 0; k < slot * 3; ++k) {
+            // user_data is the file index and the operation (0 open, 1 write, 2 close)
+            uint32_t index = (uint32_t) (cqes[k].user_data >> 2);
+            bool is_write = (cqes[k].user_data & 3) == 1;
+            // linked requests after a failed one are canceled
+            if (cqes[k].res < 0)
+                crashfmt("couldn't write file -> %s (%s)", zf_get_path(dir, index), strerror(-cqes[k].res));
+            if (is_write && (uint64_t) cqes[k].res != dir->files[index].flen)
+                crashfmt("couldn't write file -> %s (short write)", zf_get_path(dir, index));
+        }
+    }
+
+    for (unsigned slot = 0; slot < Z_URING_BATCH; ++slot)
+        free(paths[slot]);
+    free(temp_path);
+    _zf_uring_free(&ring);
+    return true;
+}
+#endif
+
+static uint8_t *_zf_train_dict(zfolder *dir, size_t dict_size, size_t *dict_len) {
+    // zstd suggests about 100 times the dictionary size worth of samples,
+    // every file is a sample and big files only give their first bytes
+    const size_t max_sample = 128 << 10;
+    uint64_t budget = (uint64_t) dict_size * 100;
+    uint64_t total = 0;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        uint64_t flen = dir->files[i].flen;
+        if (flen == 0)
+            continue;
+        total += flen < max_sample ? flen : max_sample;
+        count++;
+    }
+    if (count == 0)
+        return NULL;
+    // when there is too much data take every stride-th file, spreading the samples over the folder
+    uint64_t stride = total / budget + 1;
+
+    size_t *sizes = (size_t *) malloc((count / stride + 1) * sizeof(size_t));
+    uint8_t *samples = (uint8_t *) malloc((size_t) (total < budget ? total : budget) + max_sample);
+    uint8_t *dict = (uint8_t *) malloc(dict_size);
+    if (!sizes || !samples || !dict)
+        crash("couldn't allocate dictionary samples");
+
+    size_t nsamples = 0, samples_len = 0;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < dir->nfiles && samples_len < budget; ++i) {
+        uint64_t flen = dir->files[i].flen;
+        if (flen == 0 || seen++ % stride != 0)
+            continue;
+        size_t n = flen < max_sample ? (size_t) flen : max_sample;
+        if (dir->files[i].source == ZFILE_DISK) {
+            // only read the sample, zf_get_file would keep the whole file around
+            const char *path = zf_get_path(dir, i);
+            FILE *f = fopen(path, "rb");
+            if (!f)
+                crashfmt("couldn't open file -> %s", path);
+            _zf_fread(f, samples + samples_len, n);
+            fclose(f);
+        }
+        else {
+            memcpy(samples + samples_len, zf_get_file(dir, i), n);
+        }
+        sizes[nsamples++] = n;
+        samples_len += n;
+    }
+
+    size_t res = ZDICT_trainFromBuffer(dict, dict_size, samples, sizes, (unsigned) nsamples);
+    free(samples);
+    free(sizes);
+    // too few or too small samples, the data is compressed without a dictionary
+    if (ZDICT_isError(res)) {
+        free(dict);
+        return NULL;
+    }
+
+    *dict_len = res;
+    return dict;
+}
+
+static uint64_t _zf_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t _zf_fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void _zf_hash_update(_zf_hash *h, const uint8_t *data, size_t len) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = h->h1, h2 = h->h2;
+
+    size_t nblocks = len / 16;
+    for (size_t i = 0; i < nblocks; ++i) {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+
+        k1 *= c1; k1 = _zf_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = _zf_rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = _zf_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = _zf_rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const uint8_t *tail = data + nblocks * 16;
+    size_t rest = len & 15;
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = rest; i > 8; --i)
+        k2 ^= (uint64_t) tail[i - 1] << ((i - 9) * 8);
+    for (size_t i = rest < 8 ? rest : 8; i > 0; --i)
+        k1 ^= (uint64_t) tail[i - 1] << ((i - 1) * 8);
+    if (rest > 8) {
+        k2 *= c2; k2 = _zf_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    if (rest > 0) {
+        k1 *= c1; k1 = _zf_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h->h1 = h1;
+    h->h2 = h2;
+}
+
+static _zf_hash _zf_hash_end(_zf_hash h, uint64_t total_len) {
+    h.h1 ^= total_len;
+    h.h2 ^= total_len;
+    h.h1 += h.h2;
+    h.h2 += h.h1;
+    h.h1 = _zf_fmix64(h.h1);
+    h.h2 = _zf_fmix64(h.h2);
+    h.h1 += h.h2;
+    h.h2 += h.h1;
+    return h;
+}
+
+static _zf_hash _zf_hash_file(zfolder *dir, uint32_t index) {
+    zfile *file = &dir->files[index];
+    _zf_hash h = { 0, 0 };
+    if (file->source != ZFILE_DISK) {
+        _zf_hash_update(&h, zf_get_file(dir, index), (size_t) file->flen);
+        return _zf_hash_end(h, file->flen);
+    }
+
+    // lazy files are read in chunks instead of being kept in memory
+    const char *path = zf_get_path(dir, index);
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        crashfmt("couldn't open file -> %s", path);
+    const size_t chunk = 1 << 20;
+    uint8_t *buf = (uint8_t *) malloc(chunk);
+    if (!buf)
+        crashfmt("couldn't allocate buffer to hash %s", path);
+    for (uint64_t left = file->flen; left > 0;) {
+        size_t n = left < chunk ? (size_t) left : chunk;
+        _zf_fread(f, buf, n);
+        _zf_hash_update(&h, buf, n);
+        left -= n;
+    }
+    free(buf);
+    fclose(f);
+    return _zf_hash_end(h, file->flen);
+}
+
+static int _zf_dedup_len_cmp(const void *a, const void *b) {
+    const _zf_dedup_entry *ea = (const _zf_dedup_entry *) a;
+    const _zf_dedup_entry *eb = (const _zf_dedup_entry *) b;
+    if (ea->flen != eb->flen)
+        return ea->flen < eb->flen ? -1 : 1;
+    return ea->index < eb->index ? -1 : ea->index > eb->index;
+}
+
+static int _zf_dedup_hash_cmp(const void *a, const void *b) {
+    const _zf_dedup_entry *ea = (const _zf_dedup_entry *) a;
+    const _zf_dedup_entry *eb = (const _zf_dedup_entry *) b;
+    if (ea->hash.h1 != eb->hash.h1)
+        return ea->hash.h1 < eb->hash.h1 ? -1 : 1;
+    if (ea->hash.h2 != eb->hash.h2)
+        return ea->hash.h2 < eb->hash.h2 ? -1 : 1;
+    return ea->index < eb->index ? -1 : ea->index > eb->index;
+}
+
+static uint32_t _zf_dedup(zfolder *dir, uint32_t *orig) {
+    _zf_dedup_entry *entries = (_zf_dedup_entry *) malloc((dir->nfiles ? dir->nfiles : 1) * sizeof(_zf_dedup_entry));
+    if (!entries)
+        crash("couldn't allocate dedup table");
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        // orig isn't i for the files kept from an archive
+        if (dir->files[i].flen == 0 || orig[i] != i)
+            continue;
+        entries[count].flen = dir->files[i].flen;
+        entries[count++].index = i;
+    }
+
+    // only files with the same length can be the same, so
+    // the ones with a length of their own are never hashed
+    qsort(entries, count, sizeof(_zf_dedup_entry), _zf_dedup_len_cmp);
+    uint32_t dups = 0;
+    for (uint32_t first = 0, last; first < count; first = last) {
+        last = first + 1;
+        while (last < count && entries[last].flen == entries[first].flen)
+            last++;
+        if (last - first < 2)
+            continue;
+
+        for (uint32_t i = first; i < last; ++i)
+            entries[i].hash = _zf_hash_file(dir, entries[i].index);
+        // same hash sorted by index, so the first copy comes first
+        qsort(entries + first, last - first, sizeof(_zf_dedup_entry), _zf_dedup_hash_cmp);
+        for (uint32_t i = first + 1; i < last; ++i) {
+            _zf_dedup_entry *prev = &entries[i - 1];
+            if (entries[i].hash.h1 != prev->hash.h1 || entries[i].hash.h2 != prev->hash.h2)
+                continue;
+            // a collision keeps the file as its own copy
+            if (_zf_same_contents(dir, orig[prev->index], entries[i].index)) {
+                orig[entries[i].index] = orig[prev->index];
+                dups++;
+            }
+        }
+    }
+
+    free(entries);
+    return dups;
+}
+
+static void _zf_layout_build(_zf_layout *l, zfolder *dir, const uint32_t *orig, size_t chunk_size) {
+    memset(l, 0, sizeof(_zf_layout));
+    l->offsets = (uint64_t *) malloc((dir->nfiles ? dir->nfiles : 1) * sizeof(uint64_t));
+    l->chunked = (bool *) calloc(dir->nfiles ? dir->nfiles : 1, sizeof(bool));
+    if (!l->offsets || !l->chunked)
+        crash("couldn't allocate index");
+
+    uint64_t gear[256];
+    if (chunk_size) {
+        if (chunk_size < 64)
+            chunk_size = 64;
+        _zf_cdc_gear(gear);
+    }
+    _zf_chunk_set set;
+    memset(&set, 0, sizeof(_zf_chunk_set));
+    _zf_range_reader reader;
+    memset(&reader, 0, sizeof(_zf_range_reader));
+    reader.dir = dir;
+    // lazy files are read in a window that always has the longest chunk
+    // after pos (or the end of the file), so the cuts are the same as in memory
+    size_t max_chunk = chunk_size * 8;
+    uint8_t *window = NULL;
+    size_t window_cap = 0;
+
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        zfile *file = &dir->files[i];
+        if (orig[i] == UINT32_MAX)
+            continue;
+        if (orig[i] != i) {
+            l->offsets[i] = l->offsets[orig[i]];
+            l->chunked[i] = l->chunked[orig[i]];
+            continue;
+        }
+        if (chunk_size == 0 || file->flen <= chunk_size) {
+            l->offsets[i] = l->dlen;
+            _zf_layout_piece(l, i, 0, file->flen);
+            continue;
+        }
+
+        // lazy files are read once to find the chunks, and again to compress the new ones
+        const char *path = zf_get_path(dir, i);
+        const uint8_t *data = NULL;
+        FILE *f = NULL;
+        uint64_t start = 0; // offset of data in the file
+        uint64_t have = 0;  // bytes of the file in data
+        if (file->source == ZFILE_DISK) {
+            f = fopen(path, "rb");
+            if (!f)
+                crashfmt("couldn't open file -> %s", path);
+            if (window_cap < max_chunk * 2)
+                window = (uint8_t *) _zf_grow(window, &window_cap, max_chunk * 2, 1 << 20, 1);
+            data = window;
+        }
+        else {
+            if (file->flen > SIZE_MAX)
+                crashfmt("%s doesn't fit in memory", path);
+            data = zf_get_file(dir, i);
+            have = file->flen;
+        }
+
+        l->offsets[i] = l->nchunks;
+        l->chunked[i] = true;
+        for (uint64_t pos = 0; pos < file->flen;) {
+            size_t left = (size_t) (have - (pos - start));
+            if (f && left < max_chunk && start + have < file->flen) {
+                memmove(window, window + (pos - start), left);
+                start = pos;
+                uint64_t n = window_cap - left;
+                if (n > file->flen - start - left)
+                    n = file->flen - start - left;
+                _zf_fread(f, window + left, n);
+                have = left + n;
+                left = (size_t) have;
+            }
+
+            const uint8_t *chunk = data + (pos - start);
+            size_t n = _zf_cdc_cut(chunk, left, chunk_size, gear);
+            _zf_hash h = { 0, 0 };
+            _zf_hash_update(&h, chunk, n);
+            _zf_chunk_slot *slot = _zf_chunk_find(&set, _zf_hash_end(h, n), n);
+            uint64_t offset = slot->offset;
+            if (slot->len == 0) {
+                slot->offset = offset = l->dlen;
+                slot->len = n;
+                slot->file = i;
+                slot->foffset = pos;
+                set.count++;
+                _zf_layout_piece(l, i, pos, n);
+            }
+            else if (memcmp(_zf_range_read(&reader, slot->file, slot->foffset, n), chunk, n) != 0) {
+                // same hash but other bytes, it is stored again
+                offset = l->dlen;
+                _zf_layout_piece(l, i, pos, n);
+            }
+
+            if (l->nchunks == UINT32_MAX)
+                crash("too many chunks");
+            if (l->nchunks == l->chunkcap)
+                l->chunks = (_zf_chunk *) _zf_grow(l->chunks, &l->chunkcap, l->nchunks + 1, 256, sizeof(_zf_chunk));
+            l->chunks[l->nchunks].offset = offset;
+            l->chunks[l->nchunks++].len = n;
+            pos += n;
+        }
+        if (f)
+            fclose(f);
+    }
+
+    if (reader.f)
+        fclose(reader.f);
+    free(reader.buf);
+    free(window);
+    free(set.slots);
+}
+
+static const uint8_t *_zf_range_read(_zf_range_reader *r, uint32_t index, uint64_t offset, size_t len) {
+    zfolder *dir = r->dir;
+    if (dir->files[index].source != ZFILE_DISK)
+        return zf_get_file(dir, index) + offset;
+
+    const char *path = zf_get_path(dir, index);
+    if (!r->f || r->index != index) {
+        if (r->f)
+            fclose(r->f);
+        r->f = fopen(path, "rb");
+        if (!r->f)
+            crashfmt("couldn't open file -> %s", path);
+        r->index = index;
+    }
+    if (len > r->cap)
+        r->buf = (uint8_t *) _zf_grow(r->buf, &r->cap, len, 1 << 16, 1);
+    z_fseek(r->f, (z_off_t) offset, SEEK_SET);
+    _zf_fread(r->f, r->buf, len);
+    return r->buf;
+}
+
+static void _zf_layout_free(_zf_layout *l) {
+    free(l->pieces);
+    free(l->chunks);
+    free(l->offsets);
+    free(l->chunked);
+}
+
+static void _zf_layout_piece(_zf_layout *l, uint32_t file, uint64_t offset, uint64_t len) {
+    if (l->npieces == UINT32_MAX)
+        crash("too many pieces");
+    if (l->npieces == l->piececap)
+        l->pieces = (_zf_piece *) _zf_grow(l->pieces, &l->piececap, l->npieces + 1, 256, sizeof(_zf_piece));
+    l->pieces[l->npieces].file = file;
+    l->pieces[l->npieces].offset = offset;
+    l->pieces[l->npieces++].len = len;
+    l->dlen += len;
+}
+
+static _zf_chunk_slot *_zf_chunk_find(_zf_chunk_set *set, _zf_hash hash, uint64_t len) {
+    // keep the table at most half full
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t old_cap = set->cap;
+        _zf_chunk_slot *old = set->slots;
+        set->cap = old_cap ? old_cap * 2 : 1024;
+        set->slots = (_zf_chunk_slot *) calloc(set->cap, sizeof(_zf_chunk_slot));
+        if (!set->slots)
+            crash("couldn't allocate chunk table");
+        for (size_t i = 0; i < old_cap; ++i) {
+            if (old[i].len == 0)
+                continue;
+            size_t k = (size_t) old[i].hash.h1 & (set->cap - 1);
+            while (set->slots[k].len != 0)
+                k = (k + 1) & (set->cap - 1);
+            set->slots[k] = old[i];
+        }
+        free(old);
+    }
+
+    size_t k = (size_t) hash.h1 & (set->cap - 1);
+    while (set->slots[k].len != 0) {
+        _zf_chunk_slot *slot = &set->slots[k];
+        if (slot->len == len && slot->hash.h1 == hash.h1 && slot->hash.h2 == hash.h2)
+            return slot;
+        k = (k + 1) & (set->cap - 1);
+    }
+    set->slots[k].hash = hash;
+    return &set->slots[k];
+}
+
+static void _zf_cdc_gear(uint64_t *gear) {
+    // splitmix64, so that the chunks are the same every time
+    uint64_t x = Z_FORMAT_MAGIC;
+    for (int i = 0; i < 256; ++i) {
+        x += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static size_t _zf_cdc_cut(const uint8_t *data, size_t len, size_t avg, const uint64_t *gear) {
+    size_t min = avg / 4, max = avg * 8;
+    if (len <= min)
+        return len;
+    if (len > max)
+        len = max;
+    size_t normal = avg < len ? avg : len;
+
+    // normalized chunking: a cut is less likely before the average
+    // size and more likely after it, the gear hash shifts left so
+    // the high bits depend on the most bytes
+    int bits = 0;
+    while (((size_t) 2 << bits) <= avg)
+        bits++;
+    uint64_t mask_s = ~0ULL << (64 - (bits + 2));
+    uint64_t mask_l = ~0ULL << (64 - (bits - 2));
+
+    uint64_t fp = 0;
+    size_t i = min;
+    for (; i < normal; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & mask_s))
+            return i + 1;
+    }
+    for (; i < len; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & mask_l))
+            return i + 1;
+    }
+    return len;
+}
+
+static uint8_t *_zf_data_at(zfolder *dir, uint64_t offset) {
+    if (dir->archive) {
+        _zf_archive *ar = (_zf_archive *) dir->archive;
+        uint32_t frame = _zf_archive_find_frame(ar, offset);
+        return _zf_archive_block(ar, frame) + (offset - ar->doffsets[frame]);
+    }
+    return dir->data + offset;
+}
+
+static void _zf_load_chunks(zfolder *dir, uint32_t index) {
+    zfile *file = &dir->files[index];
+    if (file->flen > SIZE_MAX)
+        crashfmt("%s doesn't fit in memory", zf_get_path(dir, index));
+    uint8_t *data = (uint8_t *) malloc(file->flen ? (size_t) file->flen : 1);
+    if (!data)
+        crashfmt("couldn't allocate data for %s", zf_get_path(dir, index));
+
+    _zf_chunk *chunk = (_zf_chunk *) dir->chunks + file->offset;
+    for (uint64_t done = 0; done < file->flen; done += chunk->len, chunk++)
+        memcpy(data + done, _zf_data_at(dir, chunk->offset), (size_t) chunk->len);
+
+    file->source = ZFILE_MAPPED;
+    file->offset = _zf_push_map(dir, data, file->flen, false);
+}
+
+static void _zf_write_file(zfolder *dir, uint32_t index, const char *path) {
+    zfile *file = &dir->files[index];
+    if (file->source != ZFILE_CHUNKED) {
+        _write_whole_file(path, zf_get_file(dir, index), file->flen);
+        return;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        crashfmt("couldn't open file -> %s", path);
+    _zf_chunk *chunk = (_zf_chunk *) dir->chunks + file->offset;
+    for (uint64_t done = 0; done < file->flen; done += chunk->len, chunk++)
+        _zf_fwrite(f, _zf_data_at(dir, chunk->offset), chunk->len);
+    fclose(f);
+}
+
+static void _zf_stream_piece(_zf_stream_extract *sx, FILE *out, uint32_t index, uint64_t foffset, uint64_t offset, uint64_t len) {
+    // data no file points to, left by files replaced with zf_append or
+    // changed since the archive zf_compress_incremental started from
+    if (offset > sx->position) {
+        _zf_dstream_skip(sx->stream, offset - sx->position);
+        sx->position = offset;
+    }
+    if (offset == sx->position) {
+        _zf_dstream_copy(sx->stream, out, len);
+        sx->position += len;
+
+        // the bytes that follow the last extent in the same file extend it
+        _zf_extent *last = sx->nextents ? &sx->extents[sx->nextents - 1] : NULL;
+        if (last && last->file == index && last->offset + last->len == offset &&
+            last->foffset + last->len == foffset) {
+            last->len += len;
+            return;
+        }
+        if (sx->nextents == UINT32_MAX)
+            crash("too many extents");
+        if (sx->nextents == sx->extcap)
+            sx->extents = (_zf_extent *) _zf_grow(sx->extents, &sx->extcap, sx->nextents + 1, 256, sizeof(_zf_extent));
+        _zf_extent *e = &sx->extents[sx->nextents++];
+        e->offset = offset;
+        e->len = len;
+        e->file = index;
+        e->foffset = foffset;
+        return;
+    }
+
+    // last extent that starts at or before offset
+    uint32_t lo = 0, hi = sx->nextents;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (sx->extents[mid].offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    _zf_extent *e = lo > 0 ? &sx->extents[lo - 1] : NULL;
+    if (!e || offset + len > e->offset + e->len) {
+        // the stream skipped it, the file that needed it first isn't there
+        // anymore, so a second stream goes back to the frame that has it
+        _zf_archive *ar = (_zf_archive *) sx->dir->archive;
+        uint32_t frame = _zf_archive_find_frame(ar, offset);
+        if (offset + len > ar->doffsets[frame] + ar->frames[frame].dsize)
+            crashfmt("%s isn't in the order of the data", zf_get_path(sx->dir, index));
+        if (!sx->back_f) {
+            sx->back_f = fopen(sx->fname, "rb");
+            if (!sx->back_f)
+                crashfmt("couldn't open file -> %s", sx->fname);
+            _zf_dstream_init(&sx->back, sx->back_f);
+            _zf_archive_dctx(ar, sx->back.dctx);
+            sx->back_position = UINT64_MAX;
+        }
+        if (sx->back_frame != frame || offset < sx->back_position) {
+            z_fseek(sx->back_f, (z_off_t) ar->coffsets[frame], SEEK_SET);
+            ZSTD_DCtx_reset(sx->back.dctx, ZSTD_reset_session_only);
+            sx->back.input.size = 0;
+            sx->back.input.pos = 0;
+            sx->back.out_pos = 0;
+            sx->back.out_len = 0;
+            sx->back_frame = frame;
+            sx->back_position = ar->doffsets[frame];
+        }
+        _zf_dstream_skip(&sx->back, offset - sx->back_position);
+        _zf_dstream_copy(&sx->back, out, len);
+        sx->back_position = offset + len;
+        return;
+    }
+
+    // the data can be in the file that is being written
+    if (e->file == index)
+        fflush(out);
+    zfile *src = &sx->dir->files[e->file];
+    sx->path = _zf_path_buf(sx->path, &sx->cap, src->plen + sx->outlen + 1);
+    _concat_path(sx->path, zf_get_path(sx->dir, e->file), sx->output, sx->outlen);
+    _zf_copy_range(sx->path, e->foffset + (offset - e->offset), out, len);
+}
+
+static bool _zf_same_contents(zfolder *dir, uint32_t a, uint32_t b) {
+    uint64_t len = dir->files[a].flen;
+    uint32_t index[2] = { a, b };
+    const uint8_t *data[2] = { NULL, NULL };
+    FILE *f[2] = { NULL, NULL };
+    bool lazy = false;
+    for (int k = 0; k < 2; ++k) {
+        if (dir->files[index[k]].source != ZFILE_DISK) {
+            data[k] = zf_get_file(dir, index[k]);
+            continue;
+        }
+        const char *path = zf_get_path(dir, index[k]);
+        f[k] = fopen(path, "rb");
+        if (!f[k])
+            crashfmt("couldn't open file -> %s", path);
+        lazy = true;
+    }
+    if (!lazy)
+        return memcmp(data[0], data[1], (size_t) len) == 0;
+
+    // lazy files are compared a chunk at a time
+    const size_t chunk = 1 << 20;
+    uint8_t *buf = (uint8_t *) malloc(2 * chunk);
+    if (!buf)
+        crash("couldn't allocate buffer to compare files");
+    bool same = true;
+    for (uint64_t done = 0; same && done < len;) {
+        size_t n = len - done < chunk ? (size_t) (len - done) : chunk;
+        const uint8_t *p[2];
+        for (int k = 0; k < 2; ++k) {
+            if (f[k]) {
+                _zf_fread(f[k], buf + k * chunk, n);
+                p[k] = buf + k * chunk;
+            }
+            else {
+                p[k] = data[k] + done;
+            }
+        }
+        same = memcmp(p[0], p[1], n) == 0;
+        done += n;
+    }
+    free(buf);
+    for (int k = 0; k < 2; ++k) {
+        if (f[k])
+            fclose(f[k]);
+    }
+    return same;
+}
+
+static void _zf_compress_to(zfolder *dir, FILE *f, const zoptions *opt, _zf_base *base) {
+    printf("number of files: %u\n", dir->nfiles);
+    if (base)
+        _zf_base_prepare(base);
+    bool *skip = base ? base->skip : NULL;
+
+    // a duplicate points to the first file with its contents, the
+    // files kept from the archive point to UINT32_MAX (they have no data)
+    uint32_t *orig = (uint32_t *) malloc((dir->nfiles ? dir->nfiles : 1) * sizeof(uint32_t));
+    if (!orig)
+        crash("couldn't allocate index");
+    for (uint32_t i = 0; i < dir->nfiles; ++i)
+        orig[i] = skip && skip[i] ? UINT32_MAX : i;
+    if (opt->dedup)
+        _zf_dedup(dir, orig);
+
+    _zf_layout layout;
+    _zf_layout_build(&layout, dir, orig, opt->chunk_size);
+    free(orig);
+
+    // the frames kept from the archive + at most one frame
+    // per piece + the dictionary and index frames
+    uint32_t base_frames = base ? base->nframes : 0;
+    _zf_frame *frames = (_zf_frame *) malloc(((size_t) base_frames + layout.npieces + 2) * sizeof(_zf_frame));
+    if (!frames)
+        crash("couldn't allocate seek table");
+    uint32_t nframes = 0;
+    for (uint32_t k = 0; k < base_frames; ++k) {
+        if (base->used[k])
+            frames[nframes++] = base->frames[k];
+    }
+    // the used frames are copied as they are, consecutive ones together
+    for (uint32_t k = 0, last; base && base->src && k < base_frames; k = last) {
+        last = k + 1;
+        if (!base->used[k])
+            continue;
+        while (last < base_frames && base->used[last])
+            last++;
+        _zf_copy_range(base->src, base->coffsets[k], f, base->coffsets[last] - base->coffsets[k]);
+    }
+
+    _zf_cstream stream;
+    _zf_cstream_init(&stream, f, opt);
+
+    // the dictionary is digested once and used by every data frame, when
+    // appending it has to be the one of the archive (if it has one)
+    size_t dict_len = 0;
+    uint8_t *dict = NULL;
+    if (base) {
+        dict = base->dict;
+        dict_len = base->dict_len;
+    }
+    else if (opt->dict_size) {
+        dict = _zf_train_dict(dir, opt->dict_size, &dict_len);
+    }
+    ZSTD_CDict *cdict = NULL;
+    if (dict) {
+        cdict = ZSTD_createCDict(dict, dict_len, opt->level);
+        if (!cdict)
+            crash("couldn't create compression dictionary");
+        ZSTD_CCtx_refCDict(stream.cctx, cdict);
+    }
+
+    // blocks are compressed by a thread each, the zstd workers of the
+    // stream only split a single frame or a piece bigger than the block size
+    int nthreads = opt->nthreads == ZAUTO_THREADS ? _zf_cpu_count() : opt->nthreads;
+    bool parallel = nthreads > 1 && opt->block_size != 0 && layout.npieces > 1;
+    _zf_cbatch batch;
+    memset(&batch, 0, sizeof(batch));
+    _zf_compressor *workers = NULL;
+    uint32_t batch_cap = (uint32_t) nthreads * 2;
+    if (parallel) {
+        batch.dir = dir;
+        batch.pieces = layout.pieces;
+        batch.data = (const uint8_t **) malloc(layout.npieces * sizeof(uint8_t *));
+        batch.blocks = (_zf_cblock *) calloc(batch_cap, sizeof(_zf_cblock));
+        workers = (_zf_compressor *) calloc(nthreads, sizeof(_zf_compressor));
+        if (!batch.data || !batch.blocks || !workers)
+            crash("couldn't allocate compression threads");
+        _zf_mutex_init(&batch.lock);
+        for (int i = 0; i < nthreads; ++i) {
+            workers[i].batch = &batch;
+            workers[i].cctx = ZSTD_createCCtx();
+            if (!workers[i].cctx)
+                crash("couldn't create compression context");
+            _zf_cctx_params(workers[i].cctx, opt);
+            if (cdict)
+                ZSTD_CCtx_refCDict(workers[i].cctx, cdict);
+        }
+    }
+
+    // group consecutive pieces in blocks, a piece bigger
+    // than the block size gets a block of its own
+    FILE *src = NULL;
+    uint32_t src_index = 0;
+    uint32_t first = 0;
+    while (first < layout.npieces) {
+        uint64_t block_len = layout.pieces[first].len;
+        uint32_t last = first + 1;
+        while (last < layout.npieces &&
+               (opt->block_size == 0 || block_len + layout.pieces[last].len <= opt->block_size))
+            block_len += layout.pieces[last++].len;
+
+        if (parallel && block_len <= opt->block_size) {
+            _zf_cblock *block = &batch.blocks[batch.nblocks++];
+            block->first = first;
+            block->last = last;
+            block->len = block_len;
+            // zf_get_file isn't thread safe, the files on disk are read by the threads
+            for (uint32_t i = first; i < last; ++i) {
+                _zf_piece *piece = &layout.pieces[i];
+                batch.data[i] = dir->files[piece->file].source == ZFILE_DISK ? NULL :
+                                zf_get_file(dir, piece->file) + piece->offset;
+            }
+            if (batch.nblocks == batch_cap)
+                _zf_cbatch_run(&batch, workers, nthreads, &stream, frames, &nframes);
+            first = last;
+            continue;
+        }
+        // the blocks before it come first
+        if (parallel)
+            _zf_cbatch_run(&batch, workers, nthreads, &stream, frames, &nframes);
+
+        // the files aren't necessarily next to each other in memory
+        _zf_cstream_begin(&stream, block_len);
+        for (uint32_t i = first; i < last; ++i) {
+            _zf_piece *piece = &layout.pieces[i];
+            if (dir->files[piece->file].source != ZFILE_DISK) {
+                _zf_cstream_write(&stream, zf_get_file(dir, piece->file) + piece->offset, (size_t) piece->len);
+                continue;
+            }
+
+            // the chunks of a file come one after the other, so it stays open
+            const char *fpath = zf_get_path(dir, piece->file);
+            if (!src || src_index != piece->file) {
+                if (src)
+                    fclose(src);
+                src = fopen(fpath, "rb");
+                if (!src)
+                    crashfmt("couldn't open file -> %s", fpath);
+                src_index = piece->file;
+            }
+            z_fseek(src, (z_off_t) piece->offset, SEEK_SET);
+            _zf_cstream_copy(&stream, src, piece->len, fpath);
+        }
+        frames[nframes].dsize = block_len;
+        frames[nframes++].csize = _zf_cstream_end(&stream);
+
+        first = last;
+    }
+    if (src)
+        fclose(src);
+    if (parallel) {
+        _zf_cbatch_run(&batch, workers, nthreads, &stream, frames, &nframes);
+        for (int i = 0; i < nthreads; ++i) {
+            ZSTD_freeCCtx(workers[i].cctx);
+            free(workers[i].in);
+            if (workers[i].src)
+                fclose(workers[i].src);
+        }
+        for (uint32_t i = 0; i < batch_cap; ++i)
+            free(batch.blocks[i].out);
+        _zf_mutex_free(&batch.lock);
+        free(batch.blocks);
+        free(batch.data);
+        free(workers);
+    }
+
+    bool has_dict = dict != NULL;
+    if (has_dict) {
+        // the dictionary itself is compressed without it
+        ZSTD_CCtx_refCDict(stream.cctx, NULL);
+        _zf_cstream_begin(&stream, dict_len);
+        _zf_cstream_write(&stream, dict, dict_len);
+        frames[nframes].dsize = dict_len;
+        frames[nframes++].csize = _zf_cstream_end(&stream);
+        ZSTD_freeCDict(cdict);
+        if (!base)
+            free(dict);
+    }
+
+    // the offsets in the archive are the positions of the files in the
+    // compressed data, which has the files one after the other, except
+    // for the duplicates that share the offset of the first copy and
+    // the chunked files, that point to their chunks instead
+    // exact length of the index, so that it can be stored in the
+    // frame header even though it is compressed in chunks
+    // the new files and chunks come after the ones of the archive appended to
+    uint64_t nfiles = 0;
+    uint64_t total_len = 0;
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        if (skip && skip[i])
+            continue;
+        nfiles++;
+        total_len += dir->files[i].flen;
+    }
+    uint64_t dlen = layout.dlen;
+    uint64_t nchunks = layout.nchunks;
+    if (base) {
+        for (uint32_t i = 0; i < base->dir->nfiles; ++i)
+            nfiles += base->keep[i];
+        dlen += base->dlen;
+        nchunks += base->nchunks;
+    }
+    if (nfiles > UINT32_MAX || nchunks > UINT32_MAX)
+        crash("too many files");
+    // only a window bigger than the default has to be stored, the
+    // kept frames can need a bigger window than the new ones
+    int window_log = opt->window_log > Z_DEFAULT_WINDOW_LOG ? opt->window_log : 0;
+    if (base && base->window_log > window_log)
+        window_log = base->window_log;
+
+    uint64_t index_len = 0;
+    index_len += _zf_varint_size(nfiles);
+    index_len += _zf_write_entries(NULL, dir, &layout, base);
+    index_len += _zf_varint_size(dlen);
+    index_len += _zf_varint_size(has_dict);
+    index_len += _zf_varint_size(nchunks);
+    index_len += _zf_write_chunk_table(NULL, &layout, base);
+    index_len += _zf_varint_size((uint64_t) window_log);
+
+    _zf_cstream_begin(&stream, index_len);
+    _zf_cstream_varint(&stream, nfiles);
+    _zf_write_entries(&stream, dir, &layout, base);
+    _zf_cstream_varint(&stream, dlen);
+    _zf_cstream_varint(&stream, has_dict);
+    _zf_cstream_varint(&stream, nchunks);
+    _zf_write_chunk_table(&stream, &layout, base);
+    _zf_cstream_varint(&stream, (uint64_t) window_log);
+    frames[nframes].dsize = index_len;
+    frames[nframes++].csize = _zf_cstream_end(&stream);
+
+    _zf_write_seek_table(f, frames, nframes);
+
+    unsigned long long src_len = index_len + total_len;
+    unsigned long long res = stream.written;
+    _zf_cstream_free(&stream);
+    free(frames);
+    _zf_layout_free(&layout);
+
+    unsigned long long srckb = src_len / 1024;
+    unsigned long long dstkb = res / 1024;
+
+    printf("original size:   %llu b -- %llu kb\n", src_len, srckb);
+    printf("compressed size: %llu b -- %llu kb\n", res, dstkb);
+}
+
+
+static uint64_t _zf_write_entry(_zf_cstream *s, zfolder *dir, uint32_t index, uint64_t offset, bool chunked) {
+    zfile *file = &dir->files[index];
+    if (s) {
+        _zf_cstream_varint(s, file->plen);
+        _zf_cstream_varint(s, file->flen);
+        _zf_cstream_varint(s, offset);
+        _zf_cstream_write(s, dir->paths + file->path, file->plen);
+        _zf_cstream_varint(s, chunked);
+        _zf_cstream_varint(s, file->mtime);
+        _zf_cstream_varint(s, file->ino);
+    }
+    return _zf_varint_size(file->plen) + _zf_varint_size(file->flen) +
+           _zf_varint_size(offset) + file->plen + _zf_varint_size(chunked) +
+           _zf_varint_size(file->mtime) + _zf_varint_size(file->ino);
+}
+
+static uint64_t _zf_write_entries(_zf_cstream *s, zfolder *dir, _zf_layout *l, _zf_base *base) {
+    uint64_t len = 0;
+    uint64_t dlen = 0, nchunks = 0;
+    if (base) {
+        zfolder *old = base->dir;
+        for (uint32_t i = 0; i < old->nfiles; ++i) {
+            if (base->keep[i])
+                len += _zf_write_entry(s, old, i, base->offsets[i], old->files[i].source == ZFILE_CHUNKED);
+        }
+        dlen = base->dlen;
+        nchunks = base->nchunks;
+    }
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        if (base && base->skip && base->skip[i])
+            continue;
+        uint64_t offset = l->offsets[i] + (l->chunked[i] ? nchunks : dlen);
+        len += _zf_write_entry(s, dir, i, offset, l->chunked[i]);
+    }
+    return len;
+}
+
+static uint64_t _zf_write_chunk_table(_zf_cstream *s, _zf_layout *l, _zf_base *base) {
+    uint64_t len = 0;
+    uint64_t dlen = 0;
+    if (base) {
+        for (uint32_t i = 0; i < base->nchunks; ++i) {
+            if (s) {
+                _zf_cstream_varint(s, base->chunks[i].offset);
+                _zf_cstream_varint(s, base->chunks[i].len);
+            }
+            len += _zf_varint_size(base->chunks[i].offset) + _zf_varint_size(base->chunks[i].len);
+        }
+        dlen = base->dlen;
+    }
+    for (uint32_t i = 0; i < l->nchunks; ++i) {
+        if (s) {
+            _zf_cstream_varint(s, l->chunks[i].offset + dlen);
+            _zf_cstream_varint(s, l->chunks[i].len);
+        }
+        len += _zf_varint_size(l->chunks[i].offset + dlen) + _zf_varint_size(l->chunks[i].len);
+    }
+    return len;
+}
+
+static int _zf_path_cmp(const void *a, const void *b) {
+    return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+static void _zf_index_paths(zfolder *dir) {
+    // keep the table at most half full
+    size_t cap = 64;
+    while (cap < (size_t) dir->nfiles * 2)
+        cap *= 2;
+    if (cap > dir->lookcap) {
+        free(dir->lookup);
+        dir->lookup = (uint32_t *) malloc(cap * sizeof(uint32_t));
+        if (!dir->lookup)
+            crash("couldn't allocate path table");
+        dir->lookcap = cap;
+    }
+    memset(dir->lookup, 0xff, dir->lookcap * sizeof(uint32_t));
+
+    // the first of the files with the same path is the one found
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        uint32_t *slot = _zf_path_slot(dir, zf_get_path(dir, i), dir->files[i].plen);
+        if (*slot == UINT32_MAX)
+            *slot = i;
+    }
+    dir->nlookup = dir->nfiles;
+}
+
+static uint32_t *_zf_path_slot(zfolder *dir, const char *path, size_t len) {
+    _zf_hash h = { 0, 0 };
+    _zf_hash_update(&h, (const uint8_t *) path, len);
+    size_t mask = dir->lookcap - 1;
+    size_t k = (size_t) _zf_hash_end(h, len).h1 & mask;
+    while (dir->lookup[k] != UINT32_MAX) {
+        zfile *file = &dir->files[dir->lookup[k]];
+        if (file->plen == len && memcmp(dir->paths + file->path, path, len) == 0)
+            break;
+        k = (k + 1) & mask;
+    }
+    return &dir->lookup[k];
+}
+
+static void _zf_cctx_params(ZSTD_CCtx *cctx, const zoptions *opt) {
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, opt->level);
+    if (opt->long_distance)
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+    if (opt->window_log && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, opt->window_log)))
+        crashfmt("invalid window log: %d", opt->window_log);
+}
+
+static void *_zf_compress_worker(void *arg) {
+    _zf_compressor *w = (_zf_compressor *) arg;
+    _zf_cbatch *b = w->batch;
+    zfolder *dir = b->dir;
+    while (true) {
+        _zf_mutex_lock(&b->lock);
+        uint32_t job = b->next < b->nblocks ? b->next++ : b->nblocks;
+        _zf_mutex_unlock(&b->lock);
+        if (job == b->nblocks)
+            break;
+
+        // a block made of a single piece in memory is compressed where it
+        // is, the others are put together in the buffer of the thread
+        _zf_cblock *block = &b->blocks[job];
+        const uint8_t *data = b->data[block->first];
+        if (block->last - block->first > 1 || !data) {
+            if (block->len > w->in_cap)
+                w->in = (uint8_t *) _zf_grow(w->in, &w->in_cap, (size_t) block->len, 1 << 16, 1);
+            uint8_t *dst = w->in;
+            for (uint32_t i = block->first; i < block->last; ++i) {
+                _zf_piece *piece = &b->pieces[i];
+                if (b->data[i]) {
+                    memcpy(dst, b->data[i], (size_t) piece->len);
+                    dst += piece->len;
+                    continue;
+                }
+
+                // the chunks of a file come one after the other, so it stays open
+                const char *fpath = zf_get_path(dir, piece->file);
+                if (!w->src || w->src_index != piece->file) {
+                    if (w->src)
+                        fclose(w->src);
+                    w->src = fopen(fpath, "rb");
+                    if (!w->src)
+                        crashfmt("couldn't open file -> %s", fpath);
+                    w->src_index = piece->file;
+                }
+                z_fseek(w->src, (z_off_t) piece->offset, SEEK_SET);
+                if (fread(dst, 1, (size_t) piece->len, w->src) != piece->len)
+                    crashfmt("file changed while it was being compressed -> %s", fpath);
+                dst += piece->len;
+            }
+            data = w->in;
+        }
+
+        size_t bound = ZSTD_compressBound((size_t) block->len);
+        if (bound > block->out_cap)
+            block->out = (uint8_t *) _zf_grow(block->out, &block->out_cap, bound, 1 << 16, 1);
+        size_t res = ZSTD_compress2(w->cctx, block->out, block->out_cap, data, (size_t) block->len);
+        if (ZSTD_isError(res))
+            crashfmt("couldn't compress data: %s", ZSTD_getErrorName(res));
+        block->out_len = res;
+    }
+    return NULL;
+}
+
+static void _zf_cbatch_run(_zf_cbatch *b, _zf_compressor *workers, int nthreads, _zf_cstream *s, _zf_frame *frames, uint32_t *nframes) {
+    if (b->nblocks == 0)
+        return;
+    b->next = 0;
+    if ((uint32_t) nthreads > b->nblocks)
+        nthreads = (int) b->nblocks;
+    _zf_run_threads(nthreads, _zf_compress_worker, workers, sizeof(_zf_compressor));
+
+    for (uint32_t i = 0; i < b->nblocks; ++i) {
+        _zf_cblock *block = &b->blocks[i];
+        _zf_fwrite(s->f, block->out, block->out_len);
+        s->written += block->out_len;
+        frames[*nframes].dsize = block->len;
+        frames[(*nframes)++].csize = block->out_len;
+    }
+    b->nblocks = 0;
+}
+
+static bool _zf_base_open(_zf_base *base, zfolder *old, const char *path) {
+    memset(base, 0, sizeof(_zf_base));
+    zf_open(old, path);
+    _zf_archive *ar = (_zf_archive *) old->archive;
+    if (!ar)
+        return false;
+    base->dir = old;
+    base->nframes = ar->nframes;
+    base->frames = (_zf_frame *) malloc((ar->nframes ? ar->nframes : 1) * sizeof(_zf_frame));
+    base->coffsets = (uint64_t *) malloc(((size_t) ar->nframes + 1) * sizeof(uint64_t));
+    base->keep = (bool *) malloc((old->nfiles ? old->nfiles : 1) * sizeof(bool));
+    if (!base->frames || !base->coffsets || !base->keep)
+        crash("couldn't allocate archive");
+    memcpy(base->frames, ar->frames, ar->nframes * sizeof(_zf_frame));
+    memcpy(base->coffsets, ar->coffsets, ((size_t) ar->nframes + 1) * sizeof(uint64_t));
+    for (uint32_t i = 0; i < old->nfiles; ++i)
+        base->keep[i] = true;
+    base->window_log = ar->window_log;
+
+    if (ar->ddict) {
+        // the new frames use the dictionary of the archive, the
+        // dictionary frame itself was compressed without it
+        _zf_frame *fr = &ar->frames[ar->nframes];
+        if (fr->dsize > SIZE_MAX)
+            crash("dictionary doesn't fit in memory");
+        base->dict_len = (size_t) fr->dsize;
+        base->dict = (uint8_t *) malloc(base->dict_len ? base->dict_len : 1);
+        if (!base->dict)
+            crash("couldn't allocate dictionary");
+        ZSTD_DDict *ddict = ar->ddict;
+        ar->ddict = NULL;
+        _zf_archive_load(ar, ar->nframes, base->dict, NULL, NULL);
+        ar->ddict = ddict;
+    }
+    return true;
+}
+
+static void _zf_base_prepare(_zf_base *base) {
+    zfolder *old = base->dir;
+    uint32_t n = base->nframes;
+    // where the frames start in the data of the archive and in the new one
+    uint64_t *doffsets = (uint64_t *) malloc(((size_t) n + 1) * sizeof(uint64_t));
+    uint64_t *moved = (uint64_t *) malloc(((size_t) n + 1) * sizeof(uint64_t));
+    base->used = (bool *) calloc(n ? n : 1, sizeof(bool));
+    base->offsets = (uint64_t *) malloc((old->nfiles ? old->nfiles : 1) * sizeof(uint64_t));
+    if (!doffsets || !moved || !base->used || !base->offsets)
+        crash("couldn't allocate archive");
+    doffsets[0] = 0;
+    for (uint32_t k = 0; k < n; ++k)
+        doffsets[k + 1] = doffsets[k] + base->frames[k].dsize;
+
+    // when the frames are already in the output file all of them stay
+    _zf_chunk *chunks = (_zf_chunk *) old->chunks;
+    for (uint32_t k = 0; k < n && !base->src; ++k)
+        base->used[k] = true;
+    for (uint32_t i = 0; i < old->nfiles && base->src; ++i) {
+        zfile *file = &old->files[i];
+        if (!base->keep[i])
+            continue;
+        if (file->source != ZFILE_CHUNKED) {
+            _zf_base_use(base, doffsets, file->offset, file->flen);
+            continue;
+        }
+        uint64_t len = 0;
+        for (uint64_t k = file->offset; len < file->flen; len += chunks[k++].len)
+            _zf_base_use(base, doffsets, chunks[k].offset, chunks[k].len);
+    }
+
+    moved[0] = 0;
+    for (uint32_t k = 0; k < n; ++k)
+        moved[k + 1] = moved[k] + (base->used[k] ? base->frames[k].dsize : 0);
+    base->dlen = moved[n];
+
+    // the chunk table only keeps the chunks of the kept files
+    for (uint32_t i = 0; i < old->nfiles; ++i) {
+        zfile *file = &old->files[i];
+        if (!base->keep[i])
+            continue;
+        if (file->source != ZFILE_CHUNKED) {
+            base->offsets[i] = _zf_base_move(base, doffsets, moved, file->offset);
+            continue;
+        }
+        base->offsets[i] = base->nchunks;
+        uint64_t len = 0;
+        for (uint64_t k = file->offset; len < file->flen; len += chunks[k++].len) {
+            if (base->nchunks == base->chunkcap)
+                base->chunks = (_zf_chunk *) _zf_grow(base->chunks, &base->chunkcap, base->nchunks + 1, 256, sizeof(_zf_chunk));
+            base->chunks[base->nchunks].offset = _zf_base_move(base, doffsets, moved, chunks[k].offset);
+            base->chunks[base->nchunks++].len = chunks[k].len;
+        }
+    }
+
+    free(doffsets);
+    free(moved);
+}
+
+static void _zf_base_use(_zf_base *base, const uint64_t *doffsets, uint64_t offset, uint64_t len) {
+    if (len == 0)
+        return;
+    uint32_t first = _zf_frame_at(doffsets, base->nframes, offset);
+    uint32_t last = _zf_frame_at(doffsets, base->nframes, offset + len - 1);
+    for (uint32_t k = first; k <= last && k < base->nframes; ++k)
+        base->used[k] = true;
+}
+
+static void _zf_base_drop_sparse(_zf_base *base, zfolder *dir) {
+    zfolder *old = base->dir;
+    uint32_t n = base->nframes;
+    uint64_t *doffsets = (uint64_t *) malloc(((size_t) n + 1) * sizeof(uint64_t));
+    uint64_t *live = (uint64_t *) calloc(n ? n : 1, sizeof(uint64_t));
+    bool *sparse = (bool *) malloc((n ? n : 1) * sizeof(bool));
+    bool *drop = (bool *) calloc(old->nfiles ? old->nfiles : 1, sizeof(bool));
+    if (!doffsets || !live || !sparse || !drop)
+        crash("couldn't allocate archive");
+    doffsets[0] = 0;
+    for (uint32_t k = 0; k < n; ++k)
+        doffsets[k + 1] = doffsets[k] + base->frames[k].dsize;
+
+    // deduplicated chunks are counted once for every file, so a frame
+    // shared by many files can look fuller than it is and be kept
+    _zf_chunk *chunks = (_zf_chunk *) old->chunks;
+    for (uint32_t i = 0; i < old->nfiles; ++i) {
+        zfile *file = &old->files[i];
+        if (!base->keep[i])
+            continue;
+        if (file->source != ZFILE_CHUNKED) {
+            _zf_base_live(base, doffsets, live, file->offset, file->flen);
+            continue;
+        }
+        uint64_t len = 0;
+        for (uint64_t k = file->offset; len < file->flen; len += chunks[k++].len)
+            _zf_base_live(base, doffsets, live, chunks[k].offset, chunks[k].len);
+    }
+    for (uint32_t k = 0; k < n; ++k)
+        sparse[k] = live[k] < base->frames[k].dsize / 100 * Z_MIN_LIVE_PERCENT;
+
+    for (uint32_t i = 0; i < old->nfiles; ++i) {
+        zfile *file = &old->files[i];
+        if (!base->keep[i])
+            continue;
+        if (file->source != ZFILE_CHUNKED) {
+            drop[i] = _zf_base_touches(base, doffsets, sparse, file->offset, file->flen);
+            continue;
+        }
+        uint64_t len = 0;
+        for (uint64_t k = file->offset; len < file->flen && !drop[i]; len += chunks[k++].len)
+            drop[i] = _zf_base_touches(base, doffsets, sparse, chunks[k].offset, chunks[k].len);
+    }
+    for (uint32_t i = 0; i < dir->nfiles; ++i) {
+        uint32_t found;
+        if (base->skip[i] && zf_find_file(old, zf_get_path(dir, i), &found) && drop[found]) {
+            base->keep[found] = false;
+            base->skip[i] = false;
+        }
+    }
+
+    free(doffsets);
+    free(live);
+    free(sparse);
+    free(drop);
+}
+
+static void _zf_base_live(_zf_base *base, const uint64_t *doffsets, uint64_t *live, uint64_t offset, uint64_t len) {
+    if (len == 0)
+        return;
+    uint32_t first = _zf_frame_at(doffsets, base->nframes, offset);
+    uint32_t last = _zf_frame_at(doffsets, base->nframes, offset + len - 1);
+    for (uint32_t k = first; k <= last && k < base->nframes; ++k) {
+        // the part of the range in the frame
+        uint64_t start = offset > doffsets[k] ? offset : doffsets[k];
+        uint64_t end = offset + len < doffsets[k + 1] ? offset + len : doffsets[k + 1];
+        live[k] += end - start;
+    }
+}
+
+static bool _zf_base_touches(_zf_base *base, const uint64_t *doffsets, const bool *sparse, uint64_t offset, uint64_t len) {
+    if (len == 0)
+        return false;
+    uint32_t first = _zf_frame_at(doffsets, base->nframes, offset);
+    uint32_t last = _zf_frame_at(doffsets, base->nframes, offset + len - 1);
+    for (uint32_t k = first; k <= last && k < base->nframes; ++k) {
+        if (sparse[k])
+            return true;
+    }
+    return false;
+}
+
+static uint64_t _zf_base_move(_zf_base *base, const uint64_t *doffsets, const uint64_t *moved, uint64_t offset) {
+    // only empty files can point to a frame that isn't used
+    uint32_t k = _zf_frame_at(doffsets, base->nframes, offset);
+    if (k >= base->nframes || !base->used[k])
+        return 0;
+    return offset - doffsets[k] + moved[k];
+}
+
+static void _zf_base_free(_zf_base *base) {
+    free(base->keep);
+    free(base->skip);
+    free(base->frames);
+    free(base->coffsets);
+    free(base->dict);
+    free(base->used);
+    free(base->offsets);
+    free(base->chunks);
+}
+
+static uint32_t _zf_frame_at(const uint64_t *doffsets, uint32_t nframes, uint64_t offset) {
+    uint32_t lo = 0, hi = nframes;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (doffsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
 #endif // Z_FOLDER_IMPLEMENTATION